@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "redis_cluster.h"
+
+/* Syscalls are counted from outside, /proc/self/io only sees read and write
+ * on files and misses send, recv and poll: make bench_syscalls runs this
+ * under perf stat -e raw_syscalls:sys_enter. */
+
+static double cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc <= 1) {
+        printf("Usage: %s <default|uring> [commands] [pipeline]\n", argv[0]);
+        return -1;
+    }
+
+    int engine = (0 == strcmp(argv[1], "uring")) ? REDIS_CLUSTER_IO_URING : REDIS_CLUSTER_IO_DEFAULT;
+    int total = argc > 2 ? atoi(argv[2]) : 100000;
+    int pipeline = argc > 3 ? atoi(argv[3]) : 64;
+
+    char ips[][64] = {
+        "127.0.0.1",
+        "127.0.0.1",
+        "127.0.0.1",
+        "127.0.0.1",
+        "127.0.0.1",
+        "127.0.0.1"
+    };
+    int ports[] = {
+        6379,
+        6380,
+        6381,
+        6382,
+        6383,
+        6384
+    };
+
+    redis_cluster_st *cluster = redis_cluster_init();
+    if (!cluster) {
+        printf("Init cluster fail.\n");
+        return -1;
+    }
+
+    int rc;
+    rc = redis_cluster_connect(cluster, (const char(*)[64])ips, ports, 6, 1000);
+    if (rc < 0) {
+        printf("Connect to redis cluster fail.\n");
+        return -1;
+    }
+
+    rc = redis_cluster_set_io_engine(cluster, engine);
+    if (rc < 0) {
+        printf("io_uring unavailable, fall back to default engine.\n");
+    }
+
+    struct timespec t0, t1;
+    double cpu0, cpu1;
+    char key[64];
+    redisReply *reply;
+    int errors = 0;
+    int i, j, n;
+
+    cpu0 = cpu_seconds();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < total; i += pipeline) {
+        n = (total - i < pipeline) ? total - i : pipeline;
+        for (j = 0; j < n; ++j) {
+            snprintf(key, sizeof(key), "bench:%d", i + j);
+            if (redis_cluster_append(cluster, key, "SET %s %d", key, i + j) < 0) {
+                ++errors;
+            }
+        }
+        for (j = 0; j < n; ++j) {
+            reply = redis_cluster_get_reply(cluster);
+            if (!reply) {
+                ++errors;
+                continue;
+            }
+            freeReplyObject(reply);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    cpu1 = cpu_seconds();
+
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("engine:        %s\n", REDIS_CLUSTER_IO_URING == cluster->io_engine ? "io_uring" : "default");
+    printf("commands:      %d (pipeline %d, errors %d)\n", total, pipeline, errors);
+    printf("throughput:    %.0f cmd/s\n", total / elapsed);
+    printf("cpu:           %.3f us/cmd\n", (cpu1 - cpu0) * 1e6 / total);
+    printf("io_uring_enter: %.3f syscalls/cmd (%llu rounds)\n", (double)cluster->io_stats.enters / total, (unsigned long long)cluster->io_stats.rounds);
+
+    redis_cluster_free(cluster);
+    return 0;
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "redis_cluster.h"
+
+/* Cluster aware counterpart of redis-cli --pipe.
+ *
+ * Reads commands from a file or stdin, either one per line (split like
+ * redis-cli does) or as raw RESP with -r, and loads them into every shard
+ * in parallel. */
+
+#define MAX_SEEDS 64
+
+static void usage(const char *name)
+{
+    printf("Usage: %s -h host:port [-h host:port ...] [-w window] [-t timeout_ms] [-r] [file]\n", name);
+    printf("  -h  seed node, may be repeated\n");
+    printf("  -w  in-flight commands per node (default 128)\n");
+    printf("  -t  timeout in milliseconds (default 1000)\n");
+    printf("  -r  input is raw RESP instead of one command per line\n");
+}
+
+static void print_stats(redis_cluster_bulk_st *bulk)
+{
+    redis_cluster_bulk_stats_st stats;
+    redis_cluster_bulk_get_stats(bulk, &stats);
+    fprintf(stderr, "commands: %llu, replies: %llu, errors: %llu, moved: %llu, ask: %llu, tryagain: %llu, %.1fs, %.0f cmd/s\n",
+            (unsigned long long)stats.commands, (unsigned long long)stats.replies, (unsigned long long)stats.errors,
+            (unsigned long long)stats.moved, (unsigned long long)stats.ask, (unsigned long long)stats.tryagain,
+            stats.elapsed, stats.elapsed > 0 ? stats.replies / stats.elapsed : 0.0);
+}
+
+/* Throughput so far, every million commands */
+static void print_progress(redis_cluster_bulk_st *bulk)
+{
+    if (0 == bulk->stats.commands % 1000000) {
+        print_stats(bulk);
+    }
+}
+
+static int load_lines(redis_cluster_bulk_st *bulk, FILE *fp)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    sds *argv;
+    const char **args = NULL;
+    size_t *argvlen = NULL;
+    int args_cap = 0;
+    int argc;
+    int rc = 0;
+    int i;
+
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        argv = sdssplitargs(line, &argc);
+        if (!argv) {
+            fprintf(stderr, "Invalid line: %s", line);
+            rc = -1;
+            continue;
+        }
+        if (argc > args_cap) {
+            args_cap = argc;
+            args = (const char **)realloc(args, args_cap * sizeof(const char *));
+            argvlen = (size_t *)realloc(argvlen, args_cap * sizeof(size_t));
+            if (!args || !argvlen) {
+                sdsfreesplitres(argv, argc);
+                rc = -1;
+                break;
+            }
+        }
+        if (argc > 0) {
+            for (i = 0; i < argc; ++i) {
+                args[i] = argv[i];
+                argvlen[i] = sdslen(argv[i]);
+            }
+            if (redis_cluster_bulk_add_argv(bulk, argc, args, argvlen) < 0) {
+                rc = -1;
+            }
+            print_progress(bulk);
+        }
+        sdsfreesplitres(argv, argc);
+    }
+
+    free(args);
+    free(argvlen);
+    free(line);
+    return rc;
+}
+
+static int load_resp(redis_cluster_bulk_st *bulk, FILE *fp)
+{
+    redisReader *reader = redisReaderCreate();
+    char buf[64 * 1024];
+    const char **args = NULL;
+    size_t *argvlen = NULL;
+    size_t args_cap = 0;
+    redisReply *reply;
+    size_t n;
+    size_t i;
+    int rc = 0;
+
+    if (!reader) {
+        return -1;
+    }
+
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        if (REDIS_OK != redisReaderFeed(reader, buf, n)) {
+            rc = -1;
+            break;
+        }
+
+        for (;;) {
+            reply = NULL;
+            if (REDIS_OK != redisReaderGetReply(reader, (void **)&reply)) {
+                fprintf(stderr, "Protocol error: %s\n", reader->errstr);
+                rc = -1;
+                goto ON_RESP_END;
+            }
+            if (!reply) {
+                break;
+            }
+
+            if (REDIS_REPLY_ARRAY != reply->type || 0 == reply->elements) {
+                fprintf(stderr, "Skip non command input.\n");
+                freeReplyObject(reply);
+                continue;
+            }
+            if (reply->elements > args_cap) {
+                args_cap = reply->elements;
+                args = (const char **)realloc(args, args_cap * sizeof(const char *));
+                argvlen = (size_t *)realloc(argvlen, args_cap * sizeof(size_t));
+                if (!args || !argvlen) {
+                    freeReplyObject(reply);
+                    rc = -1;
+                    goto ON_RESP_END;
+                }
+            }
+            for (i = 0; i < reply->elements; ++i) {
+                args[i] = reply->element[i]->str ? reply->element[i]->str : "";
+                argvlen[i] = reply->element[i]->str ? reply->element[i]->len : 0;
+            }
+            if (redis_cluster_bulk_add_argv(bulk, (int)reply->elements, args, argvlen) < 0) {
+                rc = -1;
+            }
+            print_progress(bulk);
+            freeReplyObject(reply);
+        }
+    }
+
+ON_RESP_END:
+    free(args);
+    free(argvlen);
+    redisReaderFree(reader);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    char ips[MAX_SEEDS][64];
+    int ports[MAX_SEEDS];
+    int count = 0;
+    int window = 0;
+    int timeout = 1000;
+    int raw = 0;
+    char *p;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:w:t:r")) != -1) {
+        switch (opt) {
+        case 'h':
+            p = strrchr(optarg, ':');
+            if (!p || count >= MAX_SEEDS || (size_t)(p - optarg) >= sizeof(ips[0])) {
+                usage(argv[0]);
+                return -1;
+            }
+            memcpy(ips[count], optarg, p - optarg);
+            ips[count][p - optarg] = '\0';
+            ports[count] = atoi(p + 1);
+            ++count;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            break;
+        case 'r':
+            raw = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (0 == count) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    FILE *fp = stdin;
+    if (optind < argc) {
+        fp = fopen(argv[optind], "r");
+        if (!fp) {
+            perror(argv[optind]);
+            return -1;
+        }
+    }
+
+    redis_cluster_st *cluster = redis_cluster_init();
+    if (!cluster) {
+        printf("Init cluster fail.\n");
+        return -1;
+    }
+
+    int rc;
+    rc = redis_cluster_connect(cluster, (const char(*)[64])ips, ports, count, timeout);
+    if (rc < 0) {
+        printf("Connect to redis cluster fail.\n");
+        return -1;
+    }
+
+    redis_cluster_bulk_st *bulk = redis_cluster_bulk_init(cluster, window);
+    if (!bulk) {
+        printf("Init bulk loader fail.\n");
+        redis_cluster_free(cluster);
+        return -1;
+    }
+
+    rc = raw ? load_resp(bulk, fp) : load_lines(bulk, fp);
+    if (redis_cluster_bulk_finish(bulk) < 0) {
+        rc = -1;
+    }
+    print_stats(bulk);
+
+    redis_cluster_bulk_free(bulk);
+    redis_cluster_free(cluster);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return rc < 0 ? 1 : 0;
+}
@@ -6,11 +6,21 @@
 #include <string.h>
 #include <assert.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
+/* -DREDIS_CLUSTER_NO_DEBUG keeps the log off stdout, e.g. to benchmark */
+#ifndef REDIS_CLUSTER_NO_DEBUG
 #define DEBUG
+#endif
 #ifdef DEBUG
 #define _redis_cluster_log(fmt, arg...) _redis_cluster_print_log(__LINE__, fmt, ##arg)
 void _redis_cluster_print_log(int line, const char *fmt, ...)
@@ -76,6 +86,22 @@ uint16_t _crc16(const char *buf, int len) {
     return crc;
 }
 
+/* Only the first non-empty {...} section is hashed when there is one, as CLUSTER KEYSLOT does */
+int redis_cluster_keyslot(const char *key, size_t len)
+{
+    size_t start;
+    size_t end;
+
+    for (start = 0; start < len && '{' != key[start]; ++start);
+    if (start < len) {
+        for (end = start + 1; end < len && '}' != key[end]; ++end);
+        if (end < len && end != start + 1) {
+            return _crc16(key + start + 1, end - start - 1) % REDIS_CLUSTER_SLOTS;
+        }
+    }
+    return _crc16(key, len) % REDIS_CLUSTER_SLOTS;
+}
+
 redis_cluster_node_st *_redis_cluster_node_init(int id, const char *ip, int port)
 {
     redis_cluster_node_st *result = (redis_cluster_node_st *)malloc(sizeof(redis_cluster_node_st));
@@ -87,6 +113,10 @@ redis_cluster_node_st *_redis_cluster_node_init(int id, const char *ip, int port
     strncpy(result->ip, ip, sizeof(result->ip));
     result->port = port;
     result->id = id;
+    result->pending = 0;
+    result->orphans = 0;
+    result->readonly = 0;
+    result->master_id = -1;
     return result;
 }
 
@@ -99,31 +129,89 @@ void _redis_cluster_node_free(redis_cluster_node_st *cluster_node)
 }
 
 int _redis_cluster_refresh(redis_cluster_st *cluster)
+{
+    return _redis_cluster_refresh_prefer(cluster, -1);
+}
+
+/* Connection of its own to a node busy with a pipeline, NULL on failure */
+static redisContext *_redis_cluster_side_connect(redis_cluster_st *cluster, const redis_cluster_node_st *cluster_node)
+{
+    redisContext *ctx = redisConnectWithTimeout(cluster_node->ip, cluster_node->port, cluster->timeout);
+    if (ctx && (ctx->err || REDIS_OK != redisSetTimeout(ctx, cluster->timeout))) {
+        redisFree(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+int _redis_cluster_refresh_nodes(redis_cluster_st *cluster, int failed_id)
 {
     int rc;
     redisReply *reply;
+    redisContext *ctx;
+    int order[REDIS_CLUSTER_NODE_COUNT];
+    int busy[REDIS_CLUSTER_NODE_COUNT];
+    int count = 0;
+    int busy_count = 0;
+    int start;
+    int i, k;
+
+    /* Replicas of a failed master are the first to know about its promotion */
+    for (i = 0; failed_id >= 0 && i < cluster->node_count; ++i) {
+        if (cluster->redis_nodes[i]->master_id == failed_id) {
+            order[count++] = i;
+        }
+    }
+    /* Then every other node from a random offset, so clients do not all ask node 0 */
+    start = cluster->node_count > 0 ? rand_r(&cluster->retry_seed) % cluster->node_count : 0;
+    for (k = 0; k < cluster->node_count; ++k) {
+        i = (start + k) % cluster->node_count;
+        if (i != failed_id && (failed_id < 0 || cluster->redis_nodes[i]->master_id != failed_id)) {
+            order[count++] = i;
+        }
+    }
+    if (failed_id >= 0 && failed_id < cluster->node_count) {
+        order[count++] = failed_id;
+    }
 
-    int i;
-    for (i = 0; i < cluster->node_count; ++i) {
-        if (!cluster->redis_nodes[i]->ctx) {
-            cluster->redis_nodes[i]->ctx = redisConnectWithTimeout(cluster->redis_nodes[i]->ip, cluster->redis_nodes[i]->port, cluster->timeout);
-            if (!cluster->redis_nodes[i]->ctx || cluster->redis_nodes[i]->ctx->err) {
-                if (cluster->redis_nodes[i]->ctx) {
-                    redisFree(cluster->redis_nodes[i]->ctx);
-                    cluster->redis_nodes[i]->ctx = NULL;
-                }
+    /* Nodes busy with a pipeline need a connection of their own, they go last */
+    for (k = 0, i = 0; k < count; ++k) {
+        if (cluster->redis_nodes[order[k]]->ctx && cluster->redis_nodes[order[k]]->pending > 0) {
+            busy[busy_count++] = order[k];
+        } else {
+            order[i++] = order[k];
+        }
+    }
+    memcpy(order + i, busy, busy_count * sizeof(int));
+
+    for (k = 0; k < count; ++k) {
+        i = order[k];
+        if (k >= count - busy_count) {
+            /* Pipelined replies would be read as the CLUSTER SLOTS reply */
+            ctx = _redis_cluster_side_connect(cluster, cluster->redis_nodes[i]);
+            if (!ctx) {
+                _redis_cluster_log("Refresh side connection fail.[%s:%d]", cluster->redis_nodes[i]->ip, cluster->redis_nodes[i]->port);
+                continue;
+            }
+            reply = _redis_command_cluster_slots(ctx);
+            redisFree(ctx);
+        } else {
+            if (!cluster->redis_nodes[i]->ctx && _redis_cluster_node_connect(cluster, cluster->redis_nodes[i]) < 0) {
                 _redis_cluster_log("Refresh init context fail.[%s:%d]", cluster->redis_nodes[i]->ip, cluster->redis_nodes[i]->port);
                 continue;
             }
+            reply = _redis_command_cluster_slots(cluster->redis_nodes[i]->ctx);
+            if (!reply) {
+                redisFree(cluster->redis_nodes[i]->ctx);
+                cluster->redis_nodes[i]->ctx = NULL;
+                cluster->redis_nodes[i]->pending = 0;
+            }
         }
 
-        reply = _redis_command_cluster_slots(cluster->redis_nodes[i]->ctx);
         if (!reply || REDIS_REPLY_ARRAY != reply->type) {
             if (reply) {
                 freeReplyObject(reply);
             }
-            redisFree(cluster->redis_nodes[i]->ctx);
-            cluster->redis_nodes[i]->ctx = NULL;
             _redis_cluster_log("Refresh get reply fail.");
             continue;
         }
@@ -131,8 +219,6 @@ int _redis_cluster_refresh(redis_cluster_st *cluster)
         rc = _redis_cluster_refresh_from_reply(cluster, reply);
         freeReplyObject(reply);
         if (rc < 0) {
-            redisFree(cluster->redis_nodes[i]->ctx);
-            cluster->redis_nodes[i]->ctx = NULL;
             _redis_cluster_log("Refresh from reply fail.");
             return -1;
         }
@@ -143,101 +229,193 @@ int _redis_cluster_refresh(redis_cluster_st *cluster)
     return -1;
 }
 
+int _redis_cluster_refresh_prefer(redis_cluster_st *cluster, int failed_id)
+{
+    struct timespec span_ts = {0, 0};
+    int rc;
+
+    _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_REFRESH, -1);
+    if (cluster->shm) {
+        /* One process asks the cluster, the others take its answer */
+        rc = _redis_cluster_shm_refresh(cluster, failed_id);
+    } else {
+        rc = _redis_cluster_refresh_nodes(cluster, failed_id);
+    }
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_REFRESH, -1, NULL, rc);
+    return rc;
+}
+
+static int _redis_cluster_node_lookup(redis_cluster_node_st **nodes, int count, const char *ip, int port)
+{
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (port == nodes[i]->port && 0 == strcmp(nodes[i]->ip, ip)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* -1 for an endpoint nobody can connect to: NIL or "?" when the node does not know it */
+static int _redis_cluster_reply_host(redis_cluster_st *cluster, const redisReply *host, char *ip, size_t len, int *port)
+{
+    if (REDIS_REPLY_ARRAY != host->type || host->elements < 2
+            || REDIS_REPLY_STRING != host->element[0]->type || !host->element[0]->str
+            || '\0' == host->element[0]->str[0] || 0 == strcmp(host->element[0]->str, "?")
+            || REDIS_REPLY_INTEGER != host->element[1]->type
+            || host->element[1]->integer <= 0 || host->element[1]->integer > 65535) {
+        return -1;
+    }
+
+    snprintf(ip, len, "%s", host->element[0]->str);
+    if (0 != cluster->host_mask_) {
+        _redis_cluster_hostmask_exchang(cluster->host_mask_, cluster->host_dest_, ip);
+    }
+    *port = host->element[1]->integer;
+    return 0;
+}
+
 int _redis_cluster_refresh_from_reply(redis_cluster_st *cluster, const redisReply *reply)
 {
     if (!cluster || !reply) {
         return -1;
     }
+    redis_cluster_node_st *nodes[REDIS_CLUSTER_NODE_COUNT];
+    const redisReply *entry;
     size_t i, j;
     int k;
-    int cluster_node_count = reply->elements;
-    int cluster_idx = cluster_node_count;
+    int cluster_idx = 0;
+    int master_idx = -1;
+    int node_idx;
     char ip[512];
     int port;
+    uint16_t slot_owner[REDIS_CLUSTER_SLOTS];
 
     for (i = 0; i < reply->elements; ++i) {
-        if ( ! (reply->element[i]->elements >= 3 &&
-                reply->element[i]->element[0]->type == REDIS_REPLY_INTEGER &&
-                reply->element[i]->element[1]->type == REDIS_REPLY_INTEGER &&
-                reply->element[i]->element[2]->type == REDIS_REPLY_ARRAY
+        entry = reply->element[i];
+        if ( ! (entry->elements >= 3 &&
+                entry->element[0]->type == REDIS_REPLY_INTEGER &&
+                entry->element[1]->type == REDIS_REPLY_INTEGER &&
+                entry->element[2]->type == REDIS_REPLY_ARRAY &&
+                entry->element[2]->elements >= 2 &&
+                entry->element[0]->integer >= 0 &&
+                entry->element[1]->integer < REDIS_CLUSTER_SLOTS
                 )
              ) {
             _redis_cluster_log("Invalid type.\n");
-            return -1;
+            goto ON_REFRESH_ERROR;
         }
 
-        strcpy(ip, reply->element[i]->element[2]->element[0]->str);
-        if (0 != cluster->host_mask_) {
-            _redis_cluster_hostmask_exchang(cluster->host_mask_, cluster->host_dest_, ip);
-        }
-        port = reply->element[i]->element[2]->element[1]->integer;
+        /* Master node first, then its slaves. A master serving several
+         * slot ranges is listed once per range but gets a single node. */
+        for (j = 2; j < entry->elements; ++j) {
+            if (_redis_cluster_reply_host(cluster, entry->element[j], ip, sizeof(ip), &port) < 0) {
+                /* Slots of an unknown master stay uncovered until the next refresh */
+                if (2 == j) {
+                    master_idx = -1;
+                }
+                _redis_cluster_log("Skip unusable endpoint in range (%d - %d).", (int)entry->element[0]->integer, (int)entry->element[1]->integer);
+                continue;
+            }
+            node_idx = _redis_cluster_node_lookup(nodes, cluster_idx, ip, port);
+            if (2 == j) {
+                master_idx = node_idx >= 0 ? node_idx : cluster_idx;
+            }
+            if (node_idx >= 0) {
+                continue;
+            }
+            if (cluster_idx >= REDIS_CLUSTER_NODE_COUNT) {
+                _redis_cluster_log("Too many nodes.");
+                goto ON_REFRESH_ERROR;
+            }
 
-        /* Master node */
-        /* Move old master node */
-        if (cluster->redis_nodes[i]) {
-            _redis_cluster_node_free(cluster->redis_nodes[i]);
-            cluster->redis_nodes[i] = NULL;
+            nodes[cluster_idx] = _redis_cluster_node_init(cluster_idx, ip, port);
+            if (!nodes[cluster_idx]) {
+                _redis_cluster_log("Init new node fail.");
+                goto ON_REFRESH_ERROR;
+            }
+            nodes[cluster_idx]->master_id = 2 == j ? -1 : master_idx;
+            _redis_cluster_log("%s:[%d] [%s:%d]", 2 == j ? "Master" : "Slave", cluster_idx, ip, port);
+            ++cluster_idx;
         }
+    }
 
-        /* Create new master node */
-        cluster->redis_nodes[i] = _redis_cluster_node_init(i, ip, port);
-        if (!cluster->redis_nodes[i]) {
-            _redis_cluster_log("Init new master node fail.");
-            return -1;
+    /* Uncovered slots have no handler */
+    memset(slot_owner, 0xff, sizeof(slot_owner));
+    for (i = 0; i < reply->elements; ++i) {
+        entry = reply->element[i];
+        if (_redis_cluster_reply_host(cluster, entry->element[2], ip, sizeof(ip), &port) < 0) {
+            continue;
         }
-
-        cluster->redis_nodes[i]->ctx = redisConnectWithTimeout(cluster->redis_nodes[i]->ip, cluster->redis_nodes[i]->port, cluster->timeout);
-        if (!cluster->redis_nodes[i]->ctx) {
-            _redis_cluster_log("Make new connection fail.");
-            return -1;
+        node_idx = _redis_cluster_node_lookup(nodes, cluster_idx, ip, port);
+        for (k = (int)entry->element[0]->integer; k <= (int)entry->element[1]->integer; ++k) {
+            slot_owner[k] = (uint16_t)node_idx;
         }
+        _redis_cluster_log("Slots (%d - %d) => [%d]", (int)entry->element[0]->integer, (int)entry->element[1]->integer, node_idx);
+    }
 
-        /* Slots handler */
-        for (k = (int)reply->element[i]->element[0]->integer; k <= (int)reply->element[i]->element[1]->integer; ++k) {
-            cluster->slots_handler[k] = cluster->redis_nodes[i];
-        }
+    _redis_cluster_install(cluster, nodes, cluster_idx, slot_owner);
+    if (cluster->shm) {
+        _redis_cluster_shm_publish(cluster);
+    }
+    return 0;
 
-        _redis_cluster_log("Master:[%d] (%d - %d)[%s:%d]", (int)i, (int)reply->element[i]->element[0]->integer, (int)reply->element[i]->element[1]->integer, ip, port);
+ON_REFRESH_ERROR:
+    for (k = 0; k < cluster_idx; ++k) {
+        _redis_cluster_node_free(nodes[k]);
+    }
+    return -1;
+}
 
-        /* Slave node */
-        for (j = cluster_node_count; j < reply->element[i]->elements; ++j) {
-            if (reply->element[i]->element[j]->type != REDIS_REPLY_ARRAY) {
-                continue;
-            }
+/* Switch to a new node list and slot map, slot_owner indexes nodes.
+ * Connections to nodes still part of the cluster are carried over. */
+void _redis_cluster_install(redis_cluster_st *cluster, redis_cluster_node_st **nodes, int node_count,
+        const uint16_t *slot_owner)
+{
+    _append_slot_list *slot_list = cluster->slot_list;
+    int remap[REDIS_CLUSTER_NODE_COUNT];
+    int node_idx;
+    int k;
 
-            strcpy(ip, reply->element[i]->element[j]->element[0]->str);
-            if (0 != cluster->host_mask_) {
-                _redis_cluster_hostmask_exchang(cluster->host_mask_, cluster->host_dest_, ip);
-            }
-            port = reply->element[i]->element[j]->element[1]->integer;
+    for (k = 0; k < REDIS_CLUSTER_NODE_COUNT; ++k) {
+        remap[k] = -1;
+    }
+    for (k = 0; k < node_count; ++k) {
+        node_idx = _redis_cluster_find_connection(cluster, nodes[k]->ip, nodes[k]->port);
+        if (node_idx >= 0 && cluster->redis_nodes[node_idx]->ctx) {
+            remap[node_idx] = k;
+            nodes[k]->ctx = cluster->redis_nodes[node_idx]->ctx;
+            nodes[k]->pending = cluster->redis_nodes[node_idx]->pending;
+            nodes[k]->orphans = cluster->redis_nodes[node_idx]->orphans;
+            nodes[k]->readonly = cluster->redis_nodes[node_idx]->readonly;
+            cluster->redis_nodes[node_idx]->ctx = NULL;
+        }
+    }
 
-            /* Move old slave node */
-            if (cluster->redis_nodes[cluster_idx]) {
-                _redis_cluster_node_free(cluster->redis_nodes[cluster_idx]);
-                cluster->redis_nodes[cluster_idx] = NULL;
-            }
+    /* Unread records follow their connection, the others lost their reply */
+    for (k = slot_list ? slot_list->pos : 0; slot_list && k < slot_list->count; ++k) {
+        if (slot_list->list[k].node_id >= 0) {
+            slot_list->list[k].node_id = remap[slot_list->list[k].node_id];
+        }
+    }
 
-            /* Create new slave node */
-            cluster->redis_nodes[cluster_idx] = _redis_cluster_node_init(cluster_idx, ip, port);
-            if (!cluster->redis_nodes[cluster_idx]) {
-                _redis_cluster_log("Init new slave node fail.");
-                return -1;
-            }
+    for (k = 0; k < REDIS_CLUSTER_NODE_COUNT; ++k) {
+        if (cluster->redis_nodes[k]) {
+            _redis_cluster_node_free(cluster->redis_nodes[k]);
+        }
+        cluster->redis_nodes[k] = k < node_count ? nodes[k] : NULL;
+    }
+    cluster->node_count = node_count;
 
-            cluster->redis_nodes[cluster_idx]->ctx = redisConnectWithTimeout(cluster->redis_nodes[cluster_idx]->ip, cluster->redis_nodes[cluster_idx]->port, cluster->timeout);
-            if (!cluster->redis_nodes[cluster_idx]->ctx) {
-                _redis_cluster_log("Make new connection fail.");
-                return -1;
-            }
+    for (k = 0; k < REDIS_CLUSTER_SLOTS; ++k) {
+        cluster->slots_handler[k] = slot_owner[k] < node_count ? nodes[slot_owner[k]] : NULL;
+    }
 
-            _redis_cluster_log("Slave:[%d] [%s:%d]", cluster_idx, ip, port);
+    ++cluster->topology_epoch;
 
-            ++cluster_idx;
-        }
+    if (!cluster->lazy_connect) {
+        _redis_cluster_connect_nodes(cluster);
     }
-
-    cluster->node_count = cluster_idx;
-    return 0;
 }
 
 void _redis_cluster_set_slot(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node, int slot)
@@ -265,6 +443,196 @@ int _redis_cluster_find_connection(redis_cluster_st *cluster, const char *ip, in
     return -1;
 }
 
+static long _redis_cluster_elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Start a non-blocking connect, returns the socket or -1 */
+static int _redis_cluster_socket_connect(const char *ip, int port, int *connected)
+{
+    struct addrinfo hints;
+    struct addrinfo *servinfo;
+    char port_str[8];
+    int fd;
+
+    memset(&hints, 0x00, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    if (0 != getaddrinfo(ip, port_str, &hints, &servinfo)) {
+        return -1;
+    }
+
+    fd = socket(servinfo->ai_family, servinfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, servinfo->ai_protocol);
+    if (fd >= 0) {
+        *connected = (0 == connect(fd, servinfo->ai_addr, servinfo->ai_addrlen));
+        if (!*connected && EINPROGRESS != errno) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(servinfo);
+    return fd;
+}
+
+int _redis_cluster_connect_many(const char **ips, const int *ports, int count, struct timeval tv, redisContext **ctxs)
+{
+    if (count <= 0) {
+        return 0;
+    }
+    struct pollfd *pfds = (struct pollfd *)calloc(count, sizeof(struct pollfd));
+    int *fds = (int *)calloc(count, sizeof(int));
+    if (!pfds || !fds) {
+        free(pfds);
+        free(fds);
+        return -1;
+    }
+    struct timespec start;
+    long timeout_ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    long remain;
+    int waiting = 0;
+    int connected;
+    int err;
+    int flag;
+    socklen_t len;
+    int ret = 0;
+    int i;
+
+    /* Every connect is in flight at once, so dead hosts cost one timeout in total */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) {
+        ctxs[i] = NULL;
+        pfds[i].fd = -1;
+        pfds[i].events = POLLOUT;
+        fds[i] = -1;
+        if (!ips[i] || ports[i] <= 0) {
+            continue;
+        }
+
+        connected = 0;
+        fds[i] = _redis_cluster_socket_connect(ips[i], ports[i], &connected);
+        if (fds[i] < 0) {
+            _redis_cluster_log("Connect to %s:%d fail!", ips[i], ports[i]);
+        } else if (!connected) {
+            pfds[i].fd = fds[i];
+            ++waiting;
+        }
+    }
+
+    while (waiting > 0 && (remain = timeout_ms - _redis_cluster_elapsed_ms(&start)) > 0) {
+        if (poll(pfds, count, remain) < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+        for (i = 0; i < count; ++i) {
+            if (pfds[i].fd < 0 || !pfds[i].revents) {
+                continue;
+            }
+            err = 0;
+            len = sizeof(err);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+                _redis_cluster_log("Connect to %s:%d fail!", ips[i], ports[i]);
+                close(fds[i]);
+                fds[i] = -1;
+            }
+            pfds[i].fd = -1;
+            --waiting;
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (fds[i] < 0) {
+            continue;
+        }
+        if (pfds[i].fd >= 0) {
+            _redis_cluster_log("Connect to %s:%d timeout!", ips[i], ports[i]);
+            close(fds[i]);
+            continue;
+        }
+
+        /* Hand the connected socket to hiredis as a blocking context */
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) & ~O_NONBLOCK);
+        flag = 1;
+        setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        ctxs[i] = redisConnectFd(fds[i]);
+        if (!ctxs[i]) {
+            close(fds[i]);
+            continue;
+        }
+        if (ctxs[i]->err || REDIS_OK != redisSetTimeout(ctxs[i], tv)) {
+            redisFree(ctxs[i]);
+            ctxs[i] = NULL;
+            continue;
+        }
+        ++ret;
+    }
+
+    free(pfds);
+    free(fds);
+    return ret;
+}
+
+int _redis_cluster_node_connect(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node)
+{
+    struct timespec span_ts = {0, 0};
+
+    _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_CONNECT, -1);
+    cluster_node->pending = 0;
+    cluster_node->orphans = 0;
+    cluster_node->readonly = 0;
+    cluster_node->ctx = redisConnectWithTimeout(cluster_node->ip, cluster_node->port, cluster->timeout);
+    if (!cluster_node->ctx || cluster_node->ctx->err || REDIS_OK != redisSetTimeout(cluster_node->ctx, cluster->timeout)) {
+        if (cluster_node->ctx) {
+            redisFree(cluster_node->ctx);
+            cluster_node->ctx = NULL;
+        }
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_CONNECT, -1, cluster_node, -1);
+        return -1;
+    }
+
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_CONNECT, -1, cluster_node, 0);
+    return 0;
+}
+
+int _redis_cluster_connect_nodes(redis_cluster_st *cluster)
+{
+    const char *ips[REDIS_CLUSTER_NODE_COUNT];
+    int ports[REDIS_CLUSTER_NODE_COUNT];
+    redisContext *ctxs[REDIS_CLUSTER_NODE_COUNT];
+    struct timespec span_ts = {0, 0};
+    int rc;
+    int i;
+
+    for (i = 0; i < cluster->node_count; ++i) {
+        /* Already connected ones are skipped */
+        ips[i] = cluster->redis_nodes[i]->ctx ? NULL : cluster->redis_nodes[i]->ip;
+        ports[i] = cluster->redis_nodes[i]->port;
+    }
+
+    _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_CONNECT, -1);
+    rc = _redis_cluster_connect_many(ips, ports, cluster->node_count, cluster->timeout, ctxs);
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_CONNECT, -1, NULL, rc);
+    if (rc < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < cluster->node_count; ++i) {
+        if (ctxs[i]) {
+            cluster->redis_nodes[i]->ctx = ctxs[i];
+            cluster->redis_nodes[i]->pending = 0;
+            cluster->redis_nodes[i]->orphans = 0;
+            cluster->redis_nodes[i]->readonly = 0;
+        }
+    }
+
+    return 0;
+}
+
 _append_slot_list *_slot_list_init()
 {
     _append_slot_list *handler_list = (_append_slot_list *)malloc(sizeof(_append_slot_list));
@@ -272,7 +640,7 @@ _append_slot_list *_slot_list_init()
         return NULL;
     }
 
-    handler_list->list = (_append_slot_record *)malloc(DEFAULT_LIST_SIZE * sizeof(_append_slot_record));
+    handler_list->list = (_append_slot_record *)calloc(DEFAULT_LIST_SIZE, sizeof(_append_slot_record));
     if (!handler_list->list) {
         free(handler_list);
         return NULL;
@@ -292,10 +660,10 @@ void _slot_list_free(_append_slot_list *slot_list)
     int i;
 
     if (slot_list->list) {
-        for (i = 0; i < slot_list->list_size; ++i) {
-            if (slot_list->list[i].valid_ap) {
-                va_end(slot_list->list[i].ap);
-                slot_list->list[i].valid_ap = 0;
+        for (i = 0; i < slot_list->count; ++i) {
+            free(slot_list->list[i].cmd_buf);
+            if (slot_list->list[i].parked) {
+                _redis_cluster_noreply_free(slot_list->list[i].parked);
             }
         }
         free(slot_list->list);
@@ -305,36 +673,67 @@ void _slot_list_free(_append_slot_list *slot_list)
 
 void _slot_list_reset(_append_slot_list *slot_list)
 {
+    int i;
+
+    for (i = 0; i < slot_list->count; ++i) {
+        free(slot_list->list[i].cmd_buf);
+        slot_list->list[i].cmd_buf = NULL;
+        if (slot_list->list[i].parked) {
+            _redis_cluster_noreply_free(slot_list->list[i].parked);
+            slot_list->list[i].parked = NULL;
+        }
+    }
     slot_list->count = 0;
     slot_list->pos = 0;
 }
 
-int _slot_list_add(_append_slot_list *slot_list, int slot, const char *fmt, va_list ap)
+void _slot_list_compact(_append_slot_list *slot_list)
+{
+    if (0 == slot_list->pos) {
+        return;
+    }
+    int i;
+    int remain = slot_list->count - slot_list->pos;
+
+    for (i = 0; i < slot_list->pos; ++i) {
+        free(slot_list->list[i].cmd_buf);
+    }
+
+    /* Keep records whose reply has not been read yet */
+    memmove(slot_list->list, slot_list->list + slot_list->pos, remain * sizeof(_append_slot_record));
+    for (i = remain; i < slot_list->count; ++i) {
+        slot_list->list[i].cmd_buf = NULL;
+        slot_list->list[i].parked = NULL;
+    }
+    slot_list->count = remain;
+    slot_list->pos = 0;
+}
+
+int _slot_list_add_formatted(_append_slot_list *slot_list, int slot, const char *cmd, size_t len)
 {
+    /* Read records are dropped only once they fill half of a full list,
+     * so every record moved is paid for by one read record */
+    if (slot_list->count >= slot_list->list_size && slot_list->pos >= slot_list->count / 2) {
+        _slot_list_compact(slot_list);
+    }
     if (slot_list->count >= slot_list->list_size) {
-        _append_slot_record *new_list = (_append_slot_record *)malloc(slot_list->list_size * 2 * sizeof(_append_slot_record));
+        _append_slot_record *new_list = (_append_slot_record *)realloc(slot_list->list, slot_list->list_size * 2 * sizeof(_append_slot_record));
         if (!new_list) {
             return - 1;
         }
 
-        if (slot_list->list) {
-            memcpy(new_list, slot_list->list, slot_list->list_size * sizeof(_append_slot_record));
-            free(slot_list->list);
-        }
+        memset(new_list + slot_list->list_size, 0x00, slot_list->list_size * sizeof(_append_slot_record));
         slot_list->list = new_list;
         slot_list->list_size *= 2;
     }
 
     slot_list->list[slot_list->count].slot = slot;
-
-    if (slot_list->list[slot_list->count].valid_ap) {
-        va_end(slot_list->list[slot_list->count].ap);
-    }
-    va_copy(slot_list->list[slot_list->count].ap, ap);
-    slot_list->list[slot_list->count].valid_ap = 1;
-
-    strncpy(slot_list->list[slot_list->count].fmt, fmt, sizeof(slot_list->list[slot_list->count].fmt) - 1);
-    slot_list->list[slot_list->count].fmt[sizeof(slot_list->list[slot_list->count].fmt) - 1] = '\0';
+    slot_list->list[slot_list->count].cmd = cmd;
+    slot_list->list[slot_list->count].cmd_len = len;
+    slot_list->list[slot_list->count].cmd_buf = NULL;
+    slot_list->list[slot_list->count].noreply = 0;
+    slot_list->list[slot_list->count].node_id = -1;
+    slot_list->list[slot_list->count].parked = NULL;
     ++slot_list->count;
 
     return 0;
@@ -349,6 +748,94 @@ _append_slot_record *_slot_list_get(_append_slot_list *slot_list)
     return &slot_list->list[slot_list->pos++];
 }
 
+/* Sleep before retry number attempt, -1 when the policy or its budget says stop */
+int _redis_cluster_retry_wait(redis_cluster_st *cluster, int attempt)
+{
+    redis_cluster_retry_policy_st *policy = &cluster->retry_policy;
+    struct timespec now;
+    struct timespec delay;
+    long elapsed_ms;
+    long cap;
+    long ms;
+
+    if (attempt >= policy->max_attempts) {
+        return -1;
+    }
+
+    if (policy->budget > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (now.tv_sec - cluster->retry_window_start.tv_sec) * 1000
+            + (now.tv_nsec - cluster->retry_window_start.tv_nsec) / 1000000;
+        if (elapsed_ms >= policy->budget_window_ms) {
+            cluster->retry_window_start = now;
+            cluster->retry_budget_used = 0;
+        }
+        if (cluster->retry_budget_used >= policy->budget) {
+            _redis_cluster_log("Retry budget exhausted.");
+            return -1;
+        }
+        ++cluster->retry_budget_used;
+    }
+
+    /* Exponential backoff with full jitter */
+    cap = (long)policy->base_delay_ms << (attempt < 16 ? attempt : 16);
+    if (cap > policy->max_delay_ms) {
+        cap = policy->max_delay_ms;
+    }
+    ms = cap > 0 ? rand_r(&cluster->retry_seed) % (cap + 1) : 0;
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (ms % 1000) * 1000000;
+    while (nanosleep(&delay, &delay) < 0 && EINTR == errno) {
+    }
+
+    return 0;
+}
+
+int _redis_cluster_error_class(const redisReply *reply)
+{
+    if (!reply || REDIS_REPLY_ERROR != reply->type || !reply->str) {
+        return REDIS_CLUSTER_ERR_NONE;
+    }
+    if (0 == strncmp(reply->str, "MOVED ", 6)) {
+        return REDIS_CLUSTER_ERR_MOVED;
+    }
+    if (0 == strncmp(reply->str, "ASK ", 4)) {
+        return REDIS_CLUSTER_ERR_ASK;
+    }
+    if (0 == strncmp(reply->str, "TRYAGAIN", 8)) {
+        return REDIS_CLUSTER_ERR_TRYAGAIN;
+    }
+    if (0 == strncmp(reply->str, "CLUSTERDOWN", 11)) {
+        return REDIS_CLUSTER_ERR_CLUSTERDOWN;
+    }
+    if (0 == strncmp(reply->str, "LOADING", 7)) {
+        return REDIS_CLUSTER_ERR_LOADING;
+    }
+    return REDIS_CLUSTER_ERR_OTHER;
+}
+
+int _redis_cluster_redirect_target(const char *str, int *slot, char *ip, size_t ip_len, int *port)
+{
+    /* MOVED 3999 127.0.0.1:6381 */
+    const char *s = strchr(str, ' ');
+    if (!s) {
+        return -1;
+    }
+    *slot = atoi(s + 1);
+    s = strchr(s + 1, ' ');
+    if (!s) {
+        return -1;
+    }
+    const char *p = strrchr(s + 1, ':');
+    if (!p || (size_t)(p - s - 1) >= ip_len) {
+        return -1;
+    }
+    memcpy(ip, s + 1, p - s - 1);
+    ip[p - s - 1] = '\0';
+    *port = atoi(p + 1);
+    return 0;
+}
+
 int _redis_command_ping(redisContext *ctx)
 {
     if (!ctx) {
@@ -402,65 +889,146 @@ void _redis_cluster_hostmask_exchang(uint32_t mask, uint32_t dest, char *host)
 redis_cluster_st *redis_cluster_init()
 {
     redis_cluster_st *cluster = (redis_cluster_st *)malloc(sizeof(redis_cluster_st));
+    if (!cluster) {
+        return NULL;
+    }
     memset(cluster, 0x00, sizeof(redis_cluster_st));
+    /* Per process, so jittered retries of many clients spread out */
+    cluster->retry_seed = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16) ^ (unsigned int)(uintptr_t)cluster;
     return cluster;
 }
 
-int redis_cluster_connect(redis_cluster_st *cluster, const char (*ips)[64], int *ports, int count, int timeout)
+/* Ask every seed for CLUSTER SLOTS at once, the first usable answer wins */
+static redisReply *_redis_cluster_probe_seeds(const char (*ips)[64], int *ports, int count, struct timeval tv)
 {
-    if (!ips || !ports || count < 0 || timeout <= 0) {
-        return -1;
-    }
-    redisContext *ctx = NULL;
+    const char **seed_ips = (const char **)calloc(count, sizeof(const char *));
+    redisContext **ctxs = (redisContext **)calloc(count, sizeof(redisContext *));
+    struct pollfd *pfds = (struct pollfd *)calloc(count, sizeof(struct pollfd));
     redisReply *r = NULL;
-    int rc;
-    struct timeval tv;
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = timeout % 1000;
-
+    void *reply;
+    struct timespec start;
+    long timeout_ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    long remain;
+    int waiting = 0;
+    int done;
     int i;
+
+    if (!seed_ips || !ctxs || !pfds) {
+        goto ON_PROBE_END;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
     for (i = 0; i < count; ++i) {
-        if (!ips[i] || ports[i] <= 0) {
+        seed_ips[i] = ips[i];
+    }
+    if (_redis_cluster_connect_many(seed_ips, ports, count, tv, ctxs) <= 0) {
+        goto ON_PROBE_END;
+    }
+
+    for (i = 0; i < count; ++i) {
+        pfds[i].fd = -1;
+        pfds[i].events = POLLIN;
+        if (!ctxs[i]) {
             continue;
         }
 
-        ctx = redisConnectWithTimeout(ips[i], ports[i], tv);
-        if (!ctx || ctx->err) {
-            if (ctx) {
-                redisFree(ctx);
-                ctx = NULL;
-            }
-            _redis_cluster_log("Connect to %s:%d fail!", ips[i], ports[i]);
+        done = 0;
+        if (REDIS_OK != redisAppendCommand(ctxs[i], "CLUSTER SLOTS")) {
             continue;
         }
-
-        r = _redis_command_cluster_slots(ctx);
-        if (!r || REDIS_REPLY_ARRAY != r->type) {
-            redisFree(ctx);
-            if (r) {
-                freeReplyObject(r);
-                r = NULL;
+        while (!done) {
+            if (REDIS_OK != redisBufferWrite(ctxs[i], &done)) {
+                break;
             }
-            _redis_cluster_log("Get reply fail.");
-            continue;
         }
-        break;
+        if (done) {
+            pfds[i].fd = ctxs[i]->fd;
+            ++waiting;
+        }
     }
 
-    if (!r) {
-        if (ctx) {
-            redisFree(ctx);
-            ctx = NULL;
+    while (!r && waiting > 0 && (remain = timeout_ms - _redis_cluster_elapsed_ms(&start)) > 0) {
+        if (poll(pfds, count, remain) < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
         }
-        _redis_cluster_log("Init fail.");
+        for (i = 0; i < count && !r; ++i) {
+            if (pfds[i].fd < 0 || !pfds[i].revents) {
+                continue;
+            }
+
+            reply = NULL;
+            if (REDIS_OK != redisBufferRead(ctxs[i]) || REDIS_OK != redisGetReplyFromReader(ctxs[i], &reply)) {
+                _redis_cluster_log("Get reply fail.[%s:%d]", ips[i], ports[i]);
+                pfds[i].fd = -1;
+                --waiting;
+                continue;
+            }
+            if (!reply) {
+                /* Partial reply, keep waiting */
+                continue;
+            }
+
+            pfds[i].fd = -1;
+            --waiting;
+            if (REDIS_REPLY_ARRAY == ((redisReply *)reply)->type && ((redisReply *)reply)->elements > 0) {
+                r = (redisReply *)reply;
+            } else {
+                _redis_cluster_log("Invalid reply.[%s:%d]", ips[i], ports[i]);
+                freeReplyObject(reply);
+            }
+        }
+    }
+
+ON_PROBE_END:
+    for (i = 0; ctxs && i < count; ++i) {
+        if (ctxs[i]) {
+            redisFree(ctxs[i]);
+        }
+    }
+    free(seed_ips);
+    free(ctxs);
+    free(pfds);
+    return r;
+}
+
+int redis_cluster_connect(redis_cluster_st *cluster, const char (*ips)[64], int *ports, int count, int timeout)
+{
+    if (!ips || !ports || count < 0 || timeout <= 0) {
         return -1;
     }
+    redisReply *r = NULL;
+    int rc;
+    int i;
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
 
     cluster->timeout = tv;
-    cluster->slot_list = _slot_list_init();
+    if (!cluster->slot_list) {
+        cluster->slot_list = _slot_list_init();
+    }
     if (!cluster->slot_list) {
         _redis_cluster_log("Init slot list fail.");
-        goto ON_INIT_ERROR;
+        return -1;
+    }
+
+    /* Map published by another process, the seeds are not asked */
+    if (cluster->shm && 0 == _redis_cluster_shm_adopt(cluster)) {
+        for (i = 0; i < cluster->node_count; ++i) {
+            if (cluster->lazy_connect || cluster->redis_nodes[i]->ctx) {
+                return 0;
+            }
+        }
+        _redis_cluster_log("Shared topology unreachable, asking the seeds.");
+    }
+
+    r = _redis_cluster_probe_seeds(ips, ports, count, tv);
+    if (!r) {
+        _redis_cluster_log("Init fail.");
+        return -1;
     }
 
     rc = _redis_cluster_refresh_from_reply(cluster, r);
@@ -470,7 +1038,6 @@ int redis_cluster_connect(redis_cluster_st *cluster, const char (*ips)[64], int
     }
 
     freeReplyObject(r);
-    redisFree(ctx);
     return 0;
 
 ON_INIT_ERROR:
@@ -478,10 +1045,6 @@ ON_INIT_ERROR:
         freeReplyObject(r);
         r = NULL;
     }
-    if (ctx) {
-        redisFree(ctx);
-        ctx = NULL;
-    }
     return -1;
 }
 
@@ -501,6 +1064,11 @@ void redis_cluster_free(redis_cluster_st *cluster)
     if (cluster->slot_list) {
         _slot_list_free(cluster->slot_list);
     }
+    _redis_cluster_uring_free(cluster);
+    _redis_cluster_traffic_free(cluster);
+    _redis_cluster_pubsub_free(cluster);
+    _redis_cluster_hedge_free(cluster);
+    _redis_cluster_shm_free(cluster);
     free(cluster);
 }
 
@@ -511,11 +1079,81 @@ int redis_cluster_set_hostmask(redis_cluster_st *cluster, uint32_t mask, uint32_
     return 0;
 }
 
+int redis_cluster_set_retry_policy(redis_cluster_st *cluster, const redis_cluster_retry_policy_st *policy)
+{
+    if (!cluster || !policy || policy->max_attempts < 0 || policy->base_delay_ms < 0
+            || policy->max_delay_ms < policy->base_delay_ms || policy->budget < 0
+            || (policy->budget > 0 && policy->budget_window_ms <= 0)) {
+        return -1;
+    }
+
+    cluster->retry_policy = *policy;
+    cluster->retry_budget_used = 0;
+    clock_gettime(CLOCK_MONOTONIC, &cluster->retry_window_start);
+    return 0;
+}
+
+int redis_cluster_set_lazy_connect(redis_cluster_st *cluster, int lazy)
+{
+    if (!cluster) {
+        return -1;
+    }
+
+    cluster->lazy_connect = lazy;
+    return 0;
+}
+
+int redis_cluster_set_stream(redis_cluster_st *cluster, int node_hwm, int total_hwm, redis_cluster_reply_cb cb, void *privdata)
+{
+    if (!cluster || (cb && (node_hwm <= 0 || total_hwm <= 0))) {
+        return -1;
+    }
+
+    cluster->stream_node_hwm = node_hwm;
+    cluster->stream_total_hwm = total_hwm;
+    cluster->stream_cb = cb;
+    cluster->stream_privdata = privdata;
+    return 0;
+}
+
+int redis_cluster_set_stream_bytes(redis_cluster_st *cluster, size_t bytes_hwm)
+{
+    if (!cluster) {
+        return -1;
+    }
+
+    cluster->stream_bytes_hwm = bytes_hwm;
+    return 0;
+}
+
+int redis_cluster_set_io_engine(redis_cluster_st *cluster, int engine)
+{
+    if (!cluster) {
+        return -1;
+    }
+
+    if (REDIS_CLUSTER_IO_URING == engine) {
+        if (!cluster->uring && _redis_cluster_uring_init(cluster) < 0) {
+            _redis_cluster_log("io_uring unavailable, keep default engine.");
+            cluster->io_engine = REDIS_CLUSTER_IO_DEFAULT;
+            return -1;
+        }
+        cluster->io_engine = REDIS_CLUSTER_IO_URING;
+        return 0;
+    }
+
+    _redis_cluster_uring_free(cluster);
+    cluster->io_engine = REDIS_CLUSTER_IO_DEFAULT;
+    return 0;
+}
+
 redisReply *redis_cluster_execute(redis_cluster_st *cluster, const char *key, const char *fmt, ...)
 {
-    int slot = _crc16(key, strlen(key)) % REDIS_CLUSTER_SLOTS;
+    size_t len = strlen(key);
+    int slot = redis_cluster_keyslot(key, len);
 
     _redis_cluster_log("Key[%s] Slot[%d]", key, slot);
+    _redis_cluster_traffic_key(cluster, slot, key, len);
     va_list ap;
     va_start(ap, fmt);
     redisReply *r = redis_cluster_arg_execute(cluster, slot, fmt, ap);
@@ -526,9 +1164,11 @@ redisReply *redis_cluster_execute(redis_cluster_st *cluster, const char *key, co
 
 redisReply *redis_cluster_v_execute(redis_cluster_st *cluster, const char *key, const char *fmt, va_list ap)
 {
-    int slot = _crc16(key, strlen(key)) % REDIS_CLUSTER_SLOTS;
+    size_t len = strlen(key);
+    int slot = redis_cluster_keyslot(key, len);
 
     _redis_cluster_log("Key[%s] Slot[%d]", key, slot);
+    _redis_cluster_traffic_key(cluster, slot, key, len);
     return redis_cluster_arg_execute(cluster, slot, fmt, ap);
 }
 
@@ -540,6 +1180,8 @@ redisReply *redis_cluster_arg_execute(redis_cluster_st *cluster, int slot, const
 
     int rc;
 
+    /* Fire-and-forget replies owed before this one */
+    _redis_cluster_noreply_skip(cluster);
     _slot_list_reset(cluster->slot_list);
 
     rc = redis_cluster_arg_append(cluster, slot, fmt, ap);
@@ -551,11 +1193,34 @@ redisReply *redis_cluster_arg_execute(redis_cluster_st *cluster, int slot, const
     return redis_cluster_get_reply(cluster);
 }
 
+redisReply *redis_cluster_formatted_execute(redis_cluster_st *cluster, int slot, const char *cmd, size_t len)
+{
+    if (!cluster || slot < 0 || !cmd) {
+        return NULL;
+    }
+
+    int rc;
+
+    /* Fire-and-forget replies owed before this one */
+    _redis_cluster_noreply_skip(cluster);
+    _slot_list_reset(cluster->slot_list);
+
+    rc = redis_cluster_formatted_append(cluster, slot, cmd, len);
+    if (rc < 0) {
+        _redis_cluster_log("Append command fail in redis_cluster_formatted_execute.");
+        return NULL;
+    }
+
+    return redis_cluster_get_reply(cluster);
+}
+
 int redis_cluster_append(redis_cluster_st *cluster, const char *key, const char *fmt, ...)
 {
-    int slot = _crc16(key, strlen(key)) % REDIS_CLUSTER_SLOTS;
+    size_t len = strlen(key);
+    int slot = redis_cluster_keyslot(key, len);
 
     _redis_cluster_log("Key[%s] Slot[%d]", key, slot);
+    _redis_cluster_traffic_key(cluster, slot, key, len);
     va_list ap;
     va_start(ap, fmt);
     int rc = redis_cluster_arg_append(cluster, slot, fmt, ap);
@@ -566,169 +1231,573 @@ int redis_cluster_append(redis_cluster_st *cluster, const char *key, const char
 
 int redis_cluster_v_append(redis_cluster_st *cluster, const char *key, const char *fmt, va_list ap)
 {
-    int slot = _crc16(key, strlen(key)) % REDIS_CLUSTER_SLOTS;
+    size_t len = strlen(key);
+    int slot = redis_cluster_keyslot(key, len);
+
+    _redis_cluster_traffic_key(cluster, slot, key, len);
     return redis_cluster_arg_append(cluster, slot, fmt, ap);
 }
 
+redis_cluster_node_st *_redis_cluster_slot_node(redis_cluster_st *cluster, int slot)
+{
+    int rc;
+    int attempt = 0;
+    int failed_id;
+
+    /* Replies would mix with the ones of the bulk loader */
+    if (cluster->bulk_active) {
+        return NULL;
+    }
+
+    /* Newer map published by another process, taken when no reply is owed */
+    if (cluster->shm && cluster->slot_list->pos == cluster->slot_list->count) {
+        _redis_cluster_shm_check(cluster);
+    }
+
+    while (!cluster->slots_handler[slot] || !cluster->slots_handler[slot]->ctx) {
+        if (cluster->slots_handler[slot] && 0 == _redis_cluster_node_connect(cluster, cluster->slots_handler[slot])) {
+            _redis_cluster_log("Reconnect success.");
+            break;
+        }
+
+        _redis_cluster_log("Refresh cluster.");
+        // Refresh cluster while reconnect fail.
+        failed_id = cluster->slots_handler[slot] ? cluster->slots_handler[slot]->id : -1;
+        rc = _redis_cluster_refresh_prefer(cluster, failed_id);
+        if (rc < 0) {
+            _redis_cluster_log("Refresh cluster fail.");
+        } else if (cluster->slots_handler[slot] &&
+                (cluster->slots_handler[slot]->ctx || 0 == _redis_cluster_node_connect(cluster, cluster->slots_handler[slot]))) {
+            break;
+        }
+
+        /* Failover in progress, wait for a replica to take over */
+        if (_redis_cluster_retry_wait(cluster, attempt++) < 0) {
+            _redis_cluster_log("Find slot handler connection fail.");
+            return NULL;
+        }
+    }
+
+    return cluster->slots_handler[slot];
+}
+
+int _redis_cluster_append_done(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node)
+{
+	cluster->errstr = NULL;
+
+    /* The command is queued whatever happens now, replies that could not
+     * be read reach stream_cb as NULL */
+    if (cluster->stream_cb && (cluster_node->pending >= cluster->stream_node_hwm
+                || cluster->slot_list->count - cluster->slot_list->pos >= cluster->stream_total_hwm
+                || (cluster->stream_bytes_hwm && sdslen(cluster_node->ctx->obuf) >= cluster->stream_bytes_hwm))) {
+        _redis_cluster_stream_consume(cluster, cluster_node);
+    }
+    return 0;
+}
+
 int redis_cluster_arg_append(redis_cluster_st *cluster, int slot, const char *fmt, va_list ap)
 {
-    if (!cluster || slot < 0 || !fmt) {
+    if (!cluster || slot < 0 || slot >= REDIS_CLUSTER_SLOTS || !fmt) {
+        return -1;
+    }
+
+    char *cmd = NULL;
+    int len;
+
+    /* Formatted now, the arguments may be gone by the time a redirect replays it.
+     * hiredis allocates with malloc, the record frees it. */
+    len = redisvFormatCommand(&cmd, fmt, ap);
+    if (len < 0) {
+        return -1;
+    }
+
+    return _redis_cluster_formatted_append(cluster, slot, cmd, len, _REDIS_CLUSTER_CMD_OWNED);
+}
+
+int redis_cluster_formatted_append(redis_cluster_st *cluster, int slot, const char *cmd, size_t len)
+{
+    if (!cluster || slot < 0 || slot >= REDIS_CLUSTER_SLOTS || !cmd) {
         return -1;
     }
 
+    return _redis_cluster_formatted_append(cluster, slot, cmd, len, 0);
+}
+
+/* With _REDIS_CLUSTER_CMD_OWNED the record takes cmd over, it is freed on failure as well */
+int _redis_cluster_formatted_append(redis_cluster_st *cluster, int slot, const char *cmd, size_t len, int flags)
+{
+    char *cmd_buf = (flags & _REDIS_CLUSTER_CMD_OWNED) ? (char *)cmd : NULL;
+    _append_slot_record *record;
     int rc;
-    int handler_idx;
+    redis_cluster_node_st *cluster_node;
+    struct timespec span_ts = {0, 0};
+
+    cluster->trace_current = ++cluster->trace_seq;
+    _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_APPEND, slot);
+    cluster_node = _redis_cluster_slot_node(cluster, slot);
+    if (!cluster_node) {
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_APPEND, slot, NULL, -1);
+        free(cmd_buf);
+        return -1;
+    }
 
-    handler_idx = cluster->slots_handler[slot]->id;
-    if (!cluster->redis_nodes[handler_idx]->ctx) {
-        cluster->redis_nodes[handler_idx]->ctx = redisConnectWithTimeout(cluster->redis_nodes[handler_idx]->ip, cluster->redis_nodes[handler_idx]->port, cluster->timeout);
-        if (!cluster->redis_nodes[handler_idx]->ctx || cluster->redis_nodes[handler_idx]->ctx->err) {
-            if (cluster->redis_nodes[handler_idx]->ctx) {
-                redisFree(cluster->redis_nodes[handler_idx]->ctx);
-                cluster->redis_nodes[handler_idx]->ctx = NULL;
-            }
-            _redis_cluster_log("Refresh cluster.");
-            // Refresh cluster while reconnect fail.
-            rc = _redis_cluster_refresh(cluster);
-            if (rc < 0) {
-                _redis_cluster_log("Refresh cluster fail.");
-                return -1;
-            }
+    /* Record first, a command on the wire without one would shift every reply */
+    if (_slot_list_add_formatted(cluster->slot_list, slot, cmd, len) < 0) {
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_APPEND, slot, cluster_node, -1);
+        free(cmd_buf);
+        return -1;
+    }
 
-            handler_idx = cluster->slots_handler[slot]->id;
-            if (handler_idx < 0 || !cluster->redis_nodes[handler_idx]->ctx) {
-                _redis_cluster_log("Find slot handler connection fail.");
-                return -1;
+    rc = redisAppendFormattedCommand(cluster_node->ctx, cmd, len);
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_APPEND, slot, cluster_node, REDIS_OK == rc ? 0 : -1);
+	cluster->errstr = cluster_node->ctx->errstr;
+    if (REDIS_OK != rc) {
+        --cluster->slot_list->count;
+        redisFree(cluster_node->ctx);
+        cluster_node->ctx = NULL;
+        cluster_node->pending = 0;
+        free(cmd_buf);
+        return -1;
+    }
+    ++cluster_node->pending;
+    _redis_cluster_traffic_slot(cluster, slot);
+
+    record = &cluster->slot_list->list[cluster->slot_list->count - 1];
+    record->trace_id = cluster->trace_current;
+    record->cmd_buf = cmd_buf;
+    record->node_id = cluster_node->id;
+    if (flags & _REDIS_CLUSTER_CMD_NOREPLY) {
+        record->noreply = 1;
+        ++cluster->noreply_stats.sent;
+    }
+
+    return _redis_cluster_append_done(cluster, cluster_node);
+}
+
+/* Send a pipelined command again on another connection and wait for its reply */
+static redisReply *_redis_cluster_replay(redisContext *ctx, _append_slot_record *record, int asking)
+{
+    redisReply *reply = NULL;
+
+    if (asking && REDIS_OK != redisAppendCommand(ctx, "ASKING")) {
+        return NULL;
+    }
+    if (REDIS_OK != redisAppendFormattedCommand(ctx, record->cmd, record->cmd_len)) {
+        return NULL;
+    }
+
+    if (asking) {
+        if (REDIS_OK != redisGetReply(ctx, (void **)&reply)) {
+            return NULL;
+        }
+        freeReplyObject(reply);
+        reply = NULL;
+    }
+    redisGetReply(ctx, (void **)&reply);
+    return reply;
+}
+
+/* Next reply of a node, through the I/O engine in use */
+static int _redis_cluster_node_read(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node, int noreply, redisReply **reply)
+{
+    if (noreply) {
+        return _redis_cluster_noreply_get_reply(cluster, cluster_node, (void **)reply);
+    }
+    if (REDIS_CLUSTER_IO_URING == cluster->io_engine) {
+        /* Sends and receives of every node go out in one batch */
+        return _redis_cluster_uring_get_reply(cluster, cluster_node, (void **)reply);
+    }
+    /* Socket timeout was set once at connect */
+    return redisGetReply(cluster_node->ctx, (void **)reply);
+}
+
+/* Read and drop replies nobody waits for any more, they come first on the connection */
+int _redis_cluster_discard_orphans(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node)
+{
+    redisReply *reply;
+    int rc;
+
+    while (cluster_node->orphans > 0) {
+        reply = NULL;
+        rc = cluster_node->ctx ? _redis_cluster_node_read(cluster, cluster_node, 0, &reply) : REDIS_ERR;
+        if (REDIS_OK != rc || NULL == reply) {
+            if (cluster_node->ctx) {
+                redisFree(cluster_node->ctx);
+                cluster_node->ctx = NULL;
             }
+            cluster_node->pending = 0;
+            cluster_node->orphans = 0;
+            return -1;
         }
-        _redis_cluster_log("Reconnect success.");
+        freeReplyObject(reply);
+        --cluster_node->orphans;
+        --cluster_node->pending;
     }
 
-    _redis_cluster_log("Slot[%d] handler[%s:%d]", slot, cluster->redis_nodes[handler_idx]->ip, cluster->redis_nodes[handler_idx]->port);
-    assert(cluster->redis_nodes[handler_idx]->ctx);
-    rc = redisvAppendCommand(cluster->redis_nodes[handler_idx]->ctx, fmt, ap);
-	cluster->errstr = cluster->redis_nodes[handler_idx]->ctx->errstr;
-    if (REDIS_OK != rc) {
-        redisFree(cluster->redis_nodes[handler_idx]->ctx);
-        cluster->redis_nodes[handler_idx]->ctx = NULL;
+    return 0;
+}
+
+/* Read every reply cluster_node still owes onto its record, so that the
+ * next reply on the connection is the one of a replay */
+static int _redis_cluster_park_replies(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node)
+{
+    _append_slot_list *slot_list = cluster->slot_list;
+    _append_slot_record *record;
+    redisReply *reply;
+    int rc;
+    int i;
+
+    /* The node may still owe the reply of a hedged read it lost */
+    if (_redis_cluster_discard_orphans(cluster, cluster_node) < 0) {
         return -1;
     }
 
-    if (cluster->slot_list->pos != 0) {
-        /* Next round */
-        _slot_list_reset(cluster->slot_list);
+    for (i = slot_list->pos; i < slot_list->count && cluster_node->pending > 0; ++i) {
+        record = &slot_list->list[i];
+        if (record->node_id != cluster_node->id || record->parked) {
+            continue;
+        }
+        reply = NULL;
+        rc = _redis_cluster_node_read(cluster, cluster_node, record->noreply, &reply);
+        if (REDIS_OK != rc || NULL == reply) {
+            break;
+        }
+        record->parked = reply;
+        --cluster_node->pending;
     }
 
-    rc = _slot_list_add(cluster->slot_list, slot, fmt, ap);
-    if (rc < 0) {
+    /* Failed, or owes replies no record waits for: the replay would read them */
+    if (cluster_node->pending > 0) {
+        redisFree(cluster_node->ctx);
+        cluster_node->ctx = NULL;
+        cluster_node->pending = 0;
         return -1;
     }
 
-	cluster->errstr = NULL;
     return 0;
 }
 
 redisReply *redis_cluster_get_reply(redis_cluster_st *cluster)
 {
+    _redis_cluster_noreply_skip(cluster);
+
     _append_slot_record *record = _slot_list_get(cluster->slot_list);
     if (NULL == record) {
         return NULL;
     }
 
+    return _redis_cluster_record_reply(cluster, record);
+}
+
+/* Reply of record, following redirections. No-reply records give
+ * _redis_cluster_noreply_ok instead of a reply without error. */
+redisReply *_redis_cluster_record_reply(redis_cluster_st *cluster, _append_slot_record *record)
+{
     int slot = record->slot;
     int rc;
     int handler_idx;
     redisReply *reply = NULL;
-    redisContext *redirect_ctx = NULL;
 
-    char *p, *s;
+    char ip[64];
+    int port;
     int is_ask;
-    int redirect_slot;
-
-    handler_idx = cluster->slots_handler[slot]->id;
-    if (!cluster->redis_nodes[handler_idx]->ctx) {
+    int redirect_slot = slot;
+    int redirects = 0;
+    int attempt = 0;
+    int err_class;
+    int failed_id;
+    int hop_type = 0;
+    int done;
+    struct timespec span_ts = {0, 0};
+
+    cluster->trace_current = record->trace_id;
+    if (record->parked) {
+        /* Read already, its node may have left the cluster since */
+        reply = record->parked;
+        record->parked = NULL;
+        handler_idx = record->node_id >= 0 ? record->node_id : (cluster->slots_handler[slot] ? cluster->slots_handler[slot]->id : -1);
+        if (handler_idx < 0) {
+            return reply;
+        }
+        goto ON_REPLY;
+    }
+    /* Read where it was sent, a MOVED may have changed the slot owner since */
+    handler_idx = record->node_id;
+    if (handler_idx < 0 || !cluster->redis_nodes[handler_idx] || !cluster->redis_nodes[handler_idx]->ctx) {
         return NULL;
     }
 
-    rc = redisSetTimeout(cluster->redis_nodes[handler_idx]->ctx, cluster->timeout);
-    if (REDIS_OK != rc) {
-        _redis_cluster_log("Set timeout fail.[%d]", rc);
-        redisFree(cluster->redis_nodes[handler_idx]->ctx);
-        cluster->redis_nodes[handler_idx]->ctx = NULL;
+    if (_redis_cluster_discard_orphans(cluster, cluster->redis_nodes[handler_idx]) < 0) {
+        _redis_cluster_log("Get reply fail.");
         return NULL;
     }
-
-    rc = redisGetReply(cluster->redis_nodes[handler_idx]->ctx, (void **)&reply);
+    if (cluster->trace_cb && REDIS_CLUSTER_IO_DEFAULT == cluster->io_engine
+            && sdslen(cluster->redis_nodes[handler_idx]->ctx->obuf) > 0) {
+        /* Traced apart from the wait, redisGetReply would flush as well */
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, slot);
+        do {
+            rc = redisBufferWrite(cluster->redis_nodes[handler_idx]->ctx, &done);
+        } while (REDIS_OK == rc && !done);
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, slot, cluster->redis_nodes[handler_idx], REDIS_OK == rc ? 0 : -1);
+    }
+    _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot);
+    rc = _redis_cluster_node_read(cluster, cluster->redis_nodes[handler_idx], record->noreply, &reply);
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, cluster->redis_nodes[handler_idx], REDIS_OK == rc && reply ? 0 : -1);
     if (REDIS_OK != rc || NULL == reply) {
         redisFree(cluster->redis_nodes[handler_idx]->ctx);
         cluster->redis_nodes[handler_idx]->ctx = NULL;
+        cluster->redis_nodes[handler_idx]->pending = 0;
         _redis_cluster_log("Get reply fail.");
         return NULL;
     }
+    --cluster->redis_nodes[handler_idx]->pending;
 
-    /* Cluster redirection */
+ON_REPLY:
+    /* Cluster redirection and retryable errors */
     is_ask = 0;
-    while (REDIS_REPLY_ERROR == reply->type && (0 == strncmp(reply->str,"MOVED",5) || 0 == strncmp(reply->str,"ASK",3))) {
-        if (0 == strncmp(reply->str,"ASK",3)) {
-            is_ask = 1;
-        }
-
-        p = reply->str;
-        /* Comments show the position of the pointer as:
-         *
-         * [S] for pointer 's'
-         * [P] for pointer 'p'
-         */
-        s = strchr(p, ' ');      /* MOVED[S]3999 127.0.0.1:6381 */
-        p = strchr(s + 1, ' ');    /* MOVED[S]3999[P]127.0.0.1:6381 */
-        *p = '\0';
-        redirect_slot = atoi(s + 1);
-        s = strchr(p + 1, ':');    /* MOVED 3999[P]127.0.0.1[S]6381 */
-        *s = '\0';
-        handler_idx = _redis_cluster_find_connection(cluster, p + 1, atoi(s + 1));
-        freeReplyObject(reply);
-        if (handler_idx < 0) {
-            /* Refresh cluster nodes */
-            rc = _redis_cluster_refresh(cluster);
-            if (rc < 0) {
-                _redis_cluster_log("Refresh cluster fail.");
-                return NULL;
+    for (;;) {
+        err_class = _redis_cluster_error_class(reply);
+        if (REDIS_CLUSTER_ERR_MOVED == err_class || REDIS_CLUSTER_ERR_ASK == err_class) {
+            if (++redirects > REDIS_CLUSTER_MAX_REDIRECTS) {
+                _redis_cluster_log("Too many redirections.");
+                break;
             }
+            is_ask = (REDIS_CLUSTER_ERR_ASK == err_class);
+            hop_type = REDIS_CLUSTER_SPAN_REDIRECT;
+            _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, hop_type, slot);
 
-            handler_idx = cluster->slots_handler[slot]->id;
+            rc = _redis_cluster_redirect_target(reply->str, &redirect_slot, ip, sizeof(ip), &port);
+            handler_idx = rc < 0 ? -1 : _redis_cluster_find_connection(cluster, ip, port);
+            freeReplyObject(reply);
             if (handler_idx < 0) {
-                _redis_cluster_log("Find slot handler connection fail.");
-                return NULL;
+                /* Refresh cluster nodes */
+                rc = _redis_cluster_refresh(cluster);
+                if (rc < 0) {
+                    _redis_cluster_log("Refresh cluster fail.");
+                    goto ON_HOP_FAIL;
+                }
+
+                if (!cluster->slots_handler[slot]) {
+                    _redis_cluster_log("Find slot handler connection fail.");
+                    goto ON_HOP_FAIL;
+                }
+                handler_idx = cluster->slots_handler[slot]->id;
+                is_ask = 0;
+            } else {
+                if (!is_ask) {
+                    /* Save redirection */
+                    _redis_cluster_set_slot(cluster, cluster->redis_nodes[handler_idx], slot);
+                }
             }
-        } else {
-            if (!is_ask) {
-                /* Save redirection */
-                _redis_cluster_set_slot(cluster, cluster->redis_nodes[handler_idx], slot);
+
+            _redis_cluster_log("Redirect slot[%d] to server[%s:%d]", redirect_slot, cluster->redis_nodes[handler_idx]->ip, cluster->redis_nodes[handler_idx]->port);
+        } else if (REDIS_CLUSTER_ERR_TRYAGAIN == err_class || REDIS_CLUSTER_ERR_CLUSTERDOWN == err_class
+                || REDIS_CLUSTER_ERR_LOADING == err_class) {
+            /* The command was rejected, so it is safe to send again */
+            hop_type = REDIS_CLUSTER_SPAN_RETRY;
+            _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, hop_type, slot);
+            if (_redis_cluster_retry_wait(cluster, attempt++) < 0) {
+                _REDIS_CLUSTER_SPAN_END(cluster, span_ts, hop_type, slot, cluster->redis_nodes[handler_idx], -1);
+                break;
+            }
+            _redis_cluster_log("Retry slot[%d] after [%s]", slot, reply->str);
+            freeReplyObject(reply);
+
+            if (REDIS_CLUSTER_ERR_CLUSTERDOWN == err_class) {
+                /* Slot owner failed, its replicas know who took over */
+                failed_id = cluster->redis_nodes[handler_idx]->master_id >= 0 ? cluster->redis_nodes[handler_idx]->master_id : handler_idx;
+                if (_redis_cluster_refresh_prefer(cluster, failed_id) < 0 || !cluster->slots_handler[slot]) {
+                    _redis_cluster_log("Refresh cluster fail.");
+                    goto ON_HOP_FAIL;
+                }
+                handler_idx = cluster->slots_handler[slot]->id;
+                is_ask = 0;
             }
+        } else {
+            break;
         }
 
-        _redis_cluster_log("Redirect slot[%d] to server[%s:%d]", redirect_slot, cluster->redis_nodes[handler_idx]->ip, cluster->redis_nodes[handler_idx]->port);
         if (!cluster->redis_nodes[handler_idx]->ctx) {
-            cluster->redis_nodes[handler_idx]->ctx = redisConnectWithTimeout(cluster->redis_nodes[handler_idx]->ip, cluster->redis_nodes[handler_idx]->port, cluster->timeout);
-            if (!cluster->redis_nodes[handler_idx]->ctx || cluster->redis_nodes[handler_idx]->ctx->err) {
-                if (cluster->redis_nodes[handler_idx]->ctx) {
-                    redisFree(cluster->redis_nodes[handler_idx]->ctx);
-                    cluster->redis_nodes[handler_idx]->ctx = NULL;
-                }
+            if (_redis_cluster_node_connect(cluster, cluster->redis_nodes[handler_idx]) < 0) {
                 _redis_cluster_log("Reconnect to redis server timeout.");
-                return NULL;
+                goto ON_HOP_FAIL;
             }
         }
+        /* Never replay behind pipelined replies, they would be read as the replay's */
+        if (_redis_cluster_park_replies(cluster, cluster->redis_nodes[handler_idx]) < 0) {
+            _redis_cluster_log("Get reply fail.");
+            goto ON_HOP_FAIL;
+        }
 
-        redirect_ctx = cluster->redis_nodes[handler_idx]->ctx;
-        reply = (redisReply *)(redisvCommand(redirect_ctx, record->fmt, record->ap));
+        reply = _redis_cluster_replay(cluster->redis_nodes[handler_idx]->ctx, record, is_ask);
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, hop_type, slot, cluster->redis_nodes[handler_idx], reply ? 0 : -1);
         if (!reply) {
             return NULL;
         }
     }
 
-    va_end(record->ap);
-    record->valid_ap = 0;
-
     return reply;
+
+ON_HOP_FAIL:
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, hop_type, slot, NULL, -1);
+    return NULL;
+}
+
+int redis_cluster_flush(redis_cluster_st *cluster)
+{
+    if (!cluster) {
+        return -1;
+    }
+
+    /* The io_uring round sends every output buffer anyway */
+    if (REDIS_CLUSTER_IO_URING == cluster->io_engine) {
+        return 0;
+    }
+
+    int ret = 0;
+    int done;
+    int i;
+    for (i = 0; i < cluster->node_count; ++i) {
+        if (!cluster->redis_nodes[i] || !cluster->redis_nodes[i]->ctx) {
+            continue;
+        }
+
+        done = 0;
+        while (!done) {
+            if (REDIS_OK != redisBufferWrite(cluster->redis_nodes[i]->ctx, &done)) {
+                _redis_cluster_log("Flush fail.[%s:%d]", cluster->redis_nodes[i]->ip, cluster->redis_nodes[i]->port);
+                redisFree(cluster->redis_nodes[i]->ctx);
+                cluster->redis_nodes[i]->ctx = NULL;
+                cluster->redis_nodes[i]->pending = 0;
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+int _redis_cluster_stream_consume(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node)
+{
+    uint64_t epoch = cluster->topology_epoch;
+    redisReply *reply;
+    int rc;
+
+    /* Put every node to work before blocking on the oldest reply */
+    rc = redis_cluster_flush(cluster);
+    if (_redis_cluster_noreply_skip(cluster) < 0) {
+        rc = -1;
+    }
+
+    /* Down to half the high-water mark so the next command does not hit it again.
+     * A refresh frees cluster_node, only the total counts after one. */
+    while (cluster->slot_list->pos < cluster->slot_list->count
+            && (cluster->slot_list->count - cluster->slot_list->pos > cluster->stream_total_hwm / 2
+                || (epoch == cluster->topology_epoch && cluster_node->pending > cluster->stream_node_hwm / 2))) {
+        reply = redis_cluster_get_reply(cluster);
+        if (!reply) {
+            rc = -1;
+        }
+        cluster->stream_cb(cluster, reply, cluster->stream_privdata);
+        if (reply) {
+            freeReplyObject(reply);
+        }
+        /* No-reply commands are not handed to the callback */
+        if (_redis_cluster_noreply_skip(cluster) < 0) {
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+int redis_cluster_stream_drain(redis_cluster_st *cluster)
+{
+    if (!cluster || !cluster->stream_cb || !cluster->slot_list) {
+        return -1;
+    }
+
+    redisReply *reply;
+    int rc;
+
+    rc = redis_cluster_flush(cluster);
+    if (_redis_cluster_noreply_skip(cluster) < 0) {
+        rc = -1;
+    }
+    while (cluster->slot_list->pos < cluster->slot_list->count) {
+        reply = redis_cluster_get_reply(cluster);
+        if (!reply) {
+            rc = -1;
+        }
+        cluster->stream_cb(cluster, reply, cluster->stream_privdata);
+        if (reply) {
+            freeReplyObject(reply);
+        }
+        /* No-reply commands are not handed to the callback */
+        if (_redis_cluster_noreply_skip(cluster) < 0) {
+            rc = -1;
+        }
+    }
+
+    _slot_list_reset(cluster->slot_list);
+    return rc;
+}
+
+void _redis_cluster_span_emit(redis_cluster_st *cluster, const struct timespec *start, int type, int slot,
+        const redis_cluster_node_st *cluster_node, int status)
+{
+    redis_cluster_span_st span;
+    struct timespec now;
+
+    /* Hook set while the span was open */
+    if (0 == start->tv_sec && 0 == start->tv_nsec) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    span.type = type;
+    span.request = cluster->trace_current;
+    span.slot = slot;
+    span.ip = cluster_node ? cluster_node->ip : NULL;
+    span.port = cluster_node ? cluster_node->port : 0;
+    span.status = status < 0 ? -1 : 0;
+    span.start = *start;
+    span.duration_ns = (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+    cluster->trace_cb(cluster, &span, cluster->trace_privdata);
+}
+
+int redis_cluster_set_trace(redis_cluster_st *cluster, redis_cluster_trace_cb cb, void *privdata)
+{
+    if (!cluster) {
+        return -1;
+    }
+
+    cluster->trace_cb = cb;
+    cluster->trace_privdata = privdata;
+    return 0;
+}
+
+const char *redis_cluster_span_name(int type)
+{
+    switch (type) {
+    case REDIS_CLUSTER_SPAN_CONNECT:
+        return "connect";
+    case REDIS_CLUSTER_SPAN_APPEND:
+        return "append";
+    case REDIS_CLUSTER_SPAN_WRITE:
+        return "write";
+    case REDIS_CLUSTER_SPAN_WAIT:
+        return "wait";
+    case REDIS_CLUSTER_SPAN_REDIRECT:
+        return "redirect";
+    case REDIS_CLUSTER_SPAN_RETRY:
+        return "retry";
+    case REDIS_CLUSTER_SPAN_REFRESH:
+        return "refresh";
+    case REDIS_CLUSTER_SPAN_HEDGE:
+        return "hedge";
+    default:
+        return "unknown";
+    }
 }
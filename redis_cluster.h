@@ -2,10 +2,16 @@
 #define POCO_REDIS_CLUSTER_H
 
 #include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include <stdarg.h>
 #include "hiredis/hiredis.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 uint16_t _crc16(const char *buf, int len);
 
 /* redisContext link list */
@@ -14,19 +20,27 @@ typedef struct {
     char ip[64];
     int port;
     int id;
+    int pending;    /* Appended commands whose reply has not been read */
+    int orphans;    /* Leading pending replies nobody waits for, dropped when read */
+    int readonly;   /* READONLY sent on ctx */
+    int master_id;  /* Id of the master for a slave, -1 for a master */
 } redis_cluster_node_st;
 redis_cluster_node_st *_redis_cluster_node_init(int id, const char *ip, int port);
 void _redis_cluster_node_free(redis_cluster_node_st *cluster_node);
 
-/* Pipelining cache */
+/* Pipelining cache, the RESP of every command is kept for replays */
 typedef struct {
     int slot;
-    char fmt[256 + 1];
-    va_list ap;
-    int valid_ap;
+    const char *cmd;
+    size_t cmd_len;
+    char *cmd_buf;      /* cmd when the record owns it, freed with the record */
+    int noreply;        /* Reply dropped when read, see redis_cluster_noreply.c */
+    int node_id;        /* Node the command was sent to, -1 once its connection is gone */
+    redisReply *parked; /* Reply read ahead of its turn, to free the connection for a replay */
+    uint64_t trace_id;
 } _append_slot_record;
 
-#define DEFAULT_LIST_SIZE 4096
+#define DEFAULT_LIST_SIZE 128
 typedef struct {
     _append_slot_record *list;
     int list_size;
@@ -36,28 +50,235 @@ typedef struct {
 _append_slot_list *_slot_list_init();
 void _slot_list_free(_append_slot_list *slot_list);
 void _slot_list_reset(_append_slot_list *slot_list);
-int _slot_list_add(_append_slot_list *slot_list, int slot, const char *fmt, va_list ap);
+void _slot_list_compact(_append_slot_list *slot_list);
+int _slot_list_add_formatted(_append_slot_list *slot_list, int slot, const char *cmd, size_t len);
 _append_slot_record *_slot_list_get(_append_slot_list *slot_list);
 
+/* I/O engines */
+#define REDIS_CLUSTER_IO_DEFAULT 0
+#define REDIS_CLUSTER_IO_URING 1
+typedef struct {
+    uint64_t rounds;    /* Batched send/recv rounds */
+    uint64_t enters;    /* io_uring_enter syscalls */
+} redis_cluster_io_stats_st;
+typedef struct _redis_cluster_uring_st _redis_cluster_uring_st;
+
+struct redis_cluster_st;
+/* Streaming pipeline reply callback, reply is NULL on failure and freed after return */
+typedef void (*redis_cluster_reply_cb)(struct redis_cluster_st *cluster, redisReply *reply, void *privdata);
+
+/* Retry policy for TRYAGAIN, CLUSTERDOWN, LOADING and unreachable slot owners.
+ * The delay before retry n is random in [0, min(max_delay_ms, base_delay_ms << n)].
+ * At most budget retries are spent per budget_window_ms, budget 0 means no limit. */
+typedef struct {
+    int max_attempts;   /* 0 disables retries */
+    int base_delay_ms;
+    int max_delay_ms;
+    int budget;
+    int budget_window_ms;
+} redis_cluster_retry_policy_st;
+#define REDIS_CLUSTER_MAX_REDIRECTS 16
+
+/* Traffic sampling */
+#define REDIS_CLUSTER_HOTKEY_LEN 128
+#define REDIS_CLUSTER_HOTKEY_MAX 256
+typedef struct {
+    int slot;
+    size_t len;         /* Bytes kept in key, longer keys are cut */
+    uint64_t count;     /* Estimated commands, never below the sampled count */
+    uint64_t error;     /* Overestimation bound, count - error is a lower bound */
+    char key[REDIS_CLUSTER_HOTKEY_LEN];
+} redis_cluster_hotkey_st;
+typedef struct _redis_cluster_hotkeys_st _redis_cluster_hotkeys_st;
+
+/* Sharded Pub/Sub message callback, the buffers are only valid during the call */
+typedef void (*redis_cluster_message_cb)(struct redis_cluster_st *cluster, const char *channel, size_t channel_len,
+        const char *message, size_t message_len, void *privdata);
+typedef struct _redis_cluster_pubsub_st _redis_cluster_pubsub_st;
+
+/* Large value chunk callback, return non zero to abort the transfer */
+typedef int (*redis_cluster_chunk_cb)(struct redis_cluster_st *cluster, const char *chunk, size_t len, size_t total, void *privdata);
+#define REDIS_CLUSTER_NIL -2
+
+/* Hedged reads: a read the slot master has not answered after the
+ * percentile of recent read latencies is also sent to one of its replicas,
+ * the first reply wins. */
+typedef struct {
+    int percentile;     /* e.g. 95, 0 turns hedging off */
+    int min_delay_us;   /* Lower bound of the delay, used alone until enough reads are seen */
+    int max_extra_pct;  /* Hedged reads as a share of all reads, at most */
+} redis_cluster_hedge_policy_st;
+typedef struct {
+    uint64_t reads;
+    uint64_t hedged;
+    uint64_t replica_wins;
+    int delay_us;       /* Current hedging delay */
+} redis_cluster_hedge_stats_st;
+typedef struct _redis_cluster_hedge_st _redis_cluster_hedge_st;
+
+/* Fire-and-forget commands: their replies are read without building reply
+ * objects, only top-level errors are looked at. MOVED, ASK and retryable
+ * errors are still followed, what is left is counted. */
+typedef struct {
+    uint64_t sent;
+    uint64_t errors;    /* Error replies after redirects and retries */
+    uint64_t lost;      /* Reply never read, the connection failed first */
+} redis_cluster_noreply_stats_st;
+
+/* Shared topology: the slot map lives in a file mapping shared by the
+ * processes of one host. One of them at a time refreshes and publishes it,
+ * the others switch to each new version without asking the cluster. */
+typedef struct _redis_cluster_shm_st _redis_cluster_shm_st;
+
+/* Tracing, one span per phase of a command */
+#define REDIS_CLUSTER_SPAN_CONNECT 1    /* Connecting one node, or all nodes after a refresh */
+#define REDIS_CLUSTER_SPAN_APPEND 2     /* Slot handler lookup and formatting into the output buffer */
+#define REDIS_CLUSTER_SPAN_WRITE 3      /* Flushing the output buffer */
+#define REDIS_CLUSTER_SPAN_WAIT 4       /* Server time and reading the reply */
+#define REDIS_CLUSTER_SPAN_REDIRECT 5   /* One MOVED or ASK hop, replay included */
+#define REDIS_CLUSTER_SPAN_RETRY 6      /* One TRYAGAIN, CLUSTERDOWN or LOADING retry, backoff included */
+#define REDIS_CLUSTER_SPAN_REFRESH 7    /* Slot map refresh */
+#define REDIS_CLUSTER_SPAN_HEDGE 8      /* Hedged read sent to a replica and raced, status 0 when the replica won */
+typedef struct {
+    int type;
+    uint64_t request;       /* Command the span belongs to, numbered from 1 at append, 0 for bulk and Pub/Sub I/O */
+    int slot;               /* -1 when not about one slot */
+    const char *ip;         /* Node involved, NULL when none or several */
+    int port;
+    int status;             /* 0 or -1 */
+    struct timespec start;  /* CLOCK_MONOTONIC */
+    uint64_t duration_ns;
+} redis_cluster_span_st;
+typedef void (*redis_cluster_trace_cb)(struct redis_cluster_st *cluster, const redis_cluster_span_st *span, void *privdata);
+
 /* Cluster manager */
 #define REDIS_CLUSTER_NODE_COUNT 256
 #define REDIS_CLUSTER_SLOTS 16384
-typedef struct {
+typedef struct redis_cluster_st {
     int node_count;
     redis_cluster_node_st *redis_nodes[REDIS_CLUSTER_NODE_COUNT];
     redis_cluster_node_st *slots_handler[REDIS_CLUSTER_SLOTS];
+    uint64_t *slot_traffic;     /* Commands per slot, NULL while sampling is off */
+    _redis_cluster_hotkeys_st *hotkeys;
     int state;
+    uint64_t topology_epoch;    /* Bumped on every slot map refresh */
     struct timeval timeout;
     _append_slot_list *slot_list;
 
     uint32_t host_mask_;
     uint32_t host_dest_;
 	const char* errstr;
+
+    int lazy_connect;   /* Connect to nodes on first use instead of at refresh */
+
+    redis_cluster_retry_policy_st retry_policy;
+    int retry_budget_used;
+    struct timespec retry_window_start;
+    unsigned int retry_seed;
+
+    int io_engine;
+    _redis_cluster_uring_st *uring;
+    redis_cluster_io_stats_st io_stats;
+
+    /* Streaming pipeline, disabled while stream_cb is NULL */
+    int stream_node_hwm;
+    int stream_total_hwm;
+    size_t stream_bytes_hwm;    /* Unsent bytes of one node, 0 for no limit */
+    redis_cluster_reply_cb stream_cb;
+    void *stream_privdata;
+
+    _redis_cluster_pubsub_st *pubsub;
+    _redis_cluster_hedge_st *hedge;
+    int bulk_active;    /* A bulk loader owns the node connections */
+    redis_cluster_noreply_stats_st noreply_stats;
+    _redis_cluster_shm_st *shm;
+
+    /* Tracing, spans are only timed while trace_cb is set */
+    redis_cluster_trace_cb trace_cb;
+    void *trace_privdata;
+    uint64_t trace_seq;
+    uint64_t trace_current;
 } redis_cluster_st;
 int _redis_cluster_refresh(redis_cluster_st *cluster);
+int _redis_cluster_refresh_prefer(redis_cluster_st *cluster, int failed_id);
+int _redis_cluster_retry_wait(redis_cluster_st *cluster, int attempt);
+int _redis_cluster_refresh_nodes(redis_cluster_st *cluster, int failed_id);
 int _redis_cluster_refresh_from_reply(redis_cluster_st *cluster, const redisReply *reply);
+void _redis_cluster_install(redis_cluster_st *cluster, redis_cluster_node_st **nodes, int node_count,
+        const uint16_t *slot_owner);
 void _redis_cluster_set_slot(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node, int slot);
 int _redis_cluster_find_connection(redis_cluster_st *cluster, const char *ip, int port);
+int _redis_cluster_connect_many(const char **ips, const int *ports, int count, struct timeval tv, redisContext **ctxs);
+int _redis_cluster_node_connect(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node);
+int _redis_cluster_connect_nodes(redis_cluster_st *cluster);
+redis_cluster_node_st *_redis_cluster_slot_node(redis_cluster_st *cluster, int slot);
+int _redis_cluster_append_done(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node);
+int _redis_cluster_stream_consume(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node);
+void _redis_cluster_traffic_slot(redis_cluster_st *cluster, int slot);
+void _redis_cluster_traffic_key(redis_cluster_st *cluster, int slot, const char *key, size_t len);
+void _redis_cluster_traffic_free(redis_cluster_st *cluster);
+void _redis_cluster_pubsub_free(redis_cluster_st *cluster);
+void _redis_cluster_hedge_free(redis_cluster_st *cluster);
+int _redis_cluster_shm_refresh(redis_cluster_st *cluster, int failed_id);
+int _redis_cluster_shm_adopt(redis_cluster_st *cluster);
+void _redis_cluster_shm_check(redis_cluster_st *cluster);
+void _redis_cluster_shm_publish(redis_cluster_st *cluster);
+void _redis_cluster_shm_free(redis_cluster_st *cluster);
+int _redis_cluster_discard_orphans(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node);
+/* Flags of _redis_cluster_formatted_append */
+#define _REDIS_CLUSTER_CMD_OWNED 1      /* cmd comes from malloc and goes to the record */
+#define _REDIS_CLUSTER_CMD_NOREPLY 2
+int _redis_cluster_formatted_append(redis_cluster_st *cluster, int slot, const char *cmd, size_t len, int flags);
+redisReply *_redis_cluster_record_reply(redis_cluster_st *cluster, _append_slot_record *record);
+int _redis_cluster_noreply_get_reply(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node, void **reply);
+int _redis_cluster_noreply_skip(redis_cluster_st *cluster);
+void _redis_cluster_noreply_free(void *reply);
+void _redis_cluster_span_emit(redis_cluster_st *cluster, const struct timespec *start, int type, int slot,
+        const redis_cluster_node_st *cluster_node, int status);
+
+/* USDT probes redis_cluster:span__begin(type, request, slot) and
+ * redis_cluster:span__end(type, request, slot, status), nops unless traced */
+#ifdef REDIS_CLUSTER_USE_USDT
+#include <sys/sdt.h>
+#define _REDIS_CLUSTER_PROBE_BEGIN(cluster, type, slot) DTRACE_PROBE3(redis_cluster, span__begin, type, (cluster)->trace_current, slot)
+#define _REDIS_CLUSTER_PROBE_END(cluster, type, slot, status) DTRACE_PROBE4(redis_cluster, span__end, type, (cluster)->trace_current, slot, status)
+#else
+#define _REDIS_CLUSTER_PROBE_BEGIN(cluster, type, slot)
+#define _REDIS_CLUSTER_PROBE_END(cluster, type, slot, status)
+#endif
+
+#define _REDIS_CLUSTER_SPAN_BEGIN(cluster, ts, type, slot) do { \
+    _REDIS_CLUSTER_PROBE_BEGIN(cluster, type, slot); \
+    if ((cluster)->trace_cb) { \
+        clock_gettime(CLOCK_MONOTONIC, &(ts)); \
+    } \
+} while (0)
+#define _REDIS_CLUSTER_SPAN_END(cluster, ts, type, slot, node, status) do { \
+    _REDIS_CLUSTER_PROBE_END(cluster, type, slot, status); \
+    if ((cluster)->trace_cb) { \
+        _redis_cluster_span_emit(cluster, &(ts), type, slot, node, status); \
+    } \
+} while (0)
+
+/* Traffic seen since sampling was turned on or last reset */
+typedef struct {
+    uint64_t total;
+    uint64_t slots[REDIS_CLUSTER_SLOTS];
+    int sample_rate;
+    int key_count;
+    redis_cluster_hotkey_st keys[REDIS_CLUSTER_HOTKEY_MAX];    /* Highest count first */
+} redis_cluster_traffic_snapshot_st;
+
+/* Cluster error replies */
+#define REDIS_CLUSTER_ERR_NONE 0
+#define REDIS_CLUSTER_ERR_MOVED 1
+#define REDIS_CLUSTER_ERR_ASK 2
+#define REDIS_CLUSTER_ERR_TRYAGAIN 3
+#define REDIS_CLUSTER_ERR_CLUSTERDOWN 4
+#define REDIS_CLUSTER_ERR_LOADING 5
+#define REDIS_CLUSTER_ERR_OTHER 6
+int _redis_cluster_error_class(const redisReply *reply);
+int _redis_cluster_redirect_target(const char *str, int *slot, char *ip, size_t ip_len, int *port);
 
 /* Inner interface */
 int _redis_command_ping(redisContext *ctx);
@@ -65,12 +286,39 @@ redisReply *_redis_command_cluster_slots(redisContext *ctx);
 
 void _redis_cluster_hostmask_exchang(uint32_t mask, uint32_t dest, char *host);
 
+/* io_uring engine */
+int _redis_cluster_uring_init(redis_cluster_st *cluster);
+void _redis_cluster_uring_free(redis_cluster_st *cluster);
+int _redis_cluster_uring_get_reply(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node, void **reply);
+
 /* Client interface */
+int redis_cluster_keyslot(const char *key, size_t len);
 redis_cluster_st *redis_cluster_init();
 int redis_cluster_connect(redis_cluster_st *cluster, const char (*ips)[64], int *ports, int count, int timeout);
 void redis_cluster_free(redis_cluster_st *cluster);
 
 int redis_cluster_set_hostmask(redis_cluster_st *cluster, uint32_t mask, uint32_t dest);
+int redis_cluster_set_lazy_connect(redis_cluster_st *cluster, int lazy);
+int redis_cluster_set_retry_policy(redis_cluster_st *cluster, const redis_cluster_retry_policy_st *policy);
+int redis_cluster_set_hedging(redis_cluster_st *cluster, const redis_cluster_hedge_policy_st *policy);
+int redis_cluster_get_hedge_stats(redis_cluster_st *cluster, redis_cluster_hedge_stats_st *stats);
+int redis_cluster_set_trace(redis_cluster_st *cluster, redis_cluster_trace_cb cb, void *privdata);
+/* Share the slot map through path, e.g. under /dev/shm, NULL stops sharing. Before connect, a
+ * published map spares the seeds. */
+int redis_cluster_set_shared_topology(redis_cluster_st *cluster, const char *path);
+const char *redis_cluster_span_name(int type);
+int redis_cluster_set_io_engine(redis_cluster_st *cluster, int engine);
+/* Streaming pipeline: once a node owes node_hwm replies or total_hwm are owed in all, appends
+ * read replies into cb until half of that is left. An append returns -1 only when the command
+ * was not queued, a reply that could not be read is handed to cb as NULL. */
+int redis_cluster_set_stream(redis_cluster_st *cluster, int node_hwm, int total_hwm, redis_cluster_reply_cb cb, void *privdata);
+/* Also flush and consume once a node has bytes_hwm bytes of commands waiting to be sent, 0 turns it off */
+int redis_cluster_set_stream_bytes(redis_cluster_st *cluster, size_t bytes_hwm);
+/* Count commands per slot and keep the top_k hottest of one in sample_rate keys, top_k 0 turns it off */
+int redis_cluster_set_traffic_sampling(redis_cluster_st *cluster, int top_k, int sample_rate);
+int redis_cluster_traffic_snapshot(redis_cluster_st *cluster, redis_cluster_traffic_snapshot_st *snapshot, int reset);
+/* Offer a key to the sampler, for callers of the formatted API that only pass its slot */
+int redis_cluster_traffic_key(redis_cluster_st *cluster, int slot, const char *key, size_t len);
 
 redisReply *redis_cluster_execute(redis_cluster_st *cluster, const char *key, const char *fmt, ...);
 redisReply *redis_cluster_v_execute(redis_cluster_st *cluster, const char *key, const char *fmt, va_list ap);
@@ -78,6 +326,109 @@ redisReply *redis_cluster_arg_execute(redis_cluster_st *cluster, int slot, const
 int redis_cluster_append(redis_cluster_st *cluster, const char *key, const char *fmt, ...);
 int redis_cluster_v_append(redis_cluster_st *cluster, const char *key, const char *fmt, va_list ap);
 int redis_cluster_arg_append(redis_cluster_st *cluster, int slot, const char *fmt, va_list ap);
+/* Preformatted RESP commands, cmd must stay valid until its reply has been read */
+redisReply *redis_cluster_formatted_execute(redis_cluster_st *cluster, int slot, const char *cmd, size_t len);
+int redis_cluster_formatted_append(redis_cluster_st *cluster, int slot, const char *cmd, size_t len);
 redisReply *redis_cluster_get_reply(redis_cluster_st *cluster);
+/* Fire-and-forget, no reply is returned for these. cmd is copied.
+ * The command stays in the node output buffer until the next get_reply,
+ * redis_cluster_noreply_drain or redis_cluster_flush, or until 1024 records
+ * are queued behind a no-reply one, so call drain or flush once done.
+ * 0 once queued, failures to send are counted in the noreply stats. */
+int redis_cluster_append_noreply(redis_cluster_st *cluster, const char *key, const char *fmt, ...);
+int redis_cluster_v_append_noreply(redis_cluster_st *cluster, const char *key, const char *fmt, va_list ap);
+int redis_cluster_formatted_append_noreply(redis_cluster_st *cluster, int slot, const char *cmd, size_t len);
+/* Read the replies of leading no-reply commands, get_reply does it as well */
+int redis_cluster_noreply_drain(redis_cluster_st *cluster);
+int redis_cluster_get_noreply_stats(redis_cluster_st *cluster, redis_cluster_noreply_stats_st *stats, int reset);
+/* Read only commands, hedged to a replica when enabled */
+redisReply *redis_cluster_execute_read(redis_cluster_st *cluster, const char *key, const char *fmt, ...);
+redisReply *redis_cluster_v_execute_read(redis_cluster_st *cluster, const char *key, const char *fmt, va_list ap);
+int redis_cluster_flush(redis_cluster_st *cluster);
+int redis_cluster_stream_drain(redis_cluster_st *cluster);
+
+/* Sharded Pub/Sub
+ * Channels are routed by slot and subscribed on dedicated connections to
+ * their masters. Messages are delivered to the callback by
+ * redis_cluster_pubsub_poll, which also moves subscriptions after a
+ * topology change. ssubscribe returns -1 when a channel could not be
+ * placed yet, poll keeps trying. */
+int redis_cluster_set_message_cb(redis_cluster_st *cluster, redis_cluster_message_cb cb, void *privdata);
+int redis_cluster_ssubscribe(redis_cluster_st *cluster, const char *channel);
+int redis_cluster_sunsubscribe(redis_cluster_st *cluster, const char *channel);
+int redis_cluster_spublish(redis_cluster_st *cluster, const char *channel, const char *message, size_t len);
+int redis_cluster_pubsub_poll(redis_cluster_st *cluster, int timeout_ms);
+
+/* Large values, moved between the socket and caller memory without a
+ * hiredis copy. No pipelined reply may be owed by the node of the key.
+ * get_into returns the full value length like snprintf, only cap bytes
+ * are stored, or REDIS_CLUSTER_NIL for a missing key. */
+long long redis_cluster_get_into(redis_cluster_st *cluster, const char *key, char *buf, size_t cap);
+long long redis_cluster_get_stream(redis_cluster_st *cluster, const char *key, redis_cluster_chunk_cb cb, void *privdata);
+int redis_cluster_setv(redis_cluster_st *cluster, const char *key, const struct iovec *iov, int iovcnt);
+int redis_cluster_set_from(redis_cluster_st *cluster, const char *key, const char *buf, size_t len);
+
+/* Bulk loader
+ * Keeps up to window commands in flight on every node at once. It reads the
+ * node connections directly: bulk_init fails while pipelined replies are
+ * unread, and appends fail until bulk_free. Commands of one slot keep their
+ * order, once one is queued for retry the later ones wait behind it. */
+#define REDIS_CLUSTER_BULK_MAX_ATTEMPTS 16
+typedef struct _redis_cluster_bulk_cmd {
+    char *cmd;
+    size_t len;
+    int slot;
+    int attempts;
+    int ask_node;       /* Node id for an ASK redirection, -1 otherwise */
+    int asking;         /* Placeholder for the reply of ASKING */
+    int held;           /* Counted in held of its slot, resent one at a time */
+    uint64_t seq;       /* Order of bulk_add */
+    struct timespec not_before;
+    struct _redis_cluster_bulk_cmd *next;
+} _redis_cluster_bulk_cmd;
+
+typedef struct {
+    _redis_cluster_bulk_cmd *head;
+    _redis_cluster_bulk_cmd *tail;
+    int count;
+} _redis_cluster_bulk_queue;
+
+typedef struct {
+    uint64_t commands;
+    uint64_t replies;
+    uint64_t errors;
+    uint64_t moved;
+    uint64_t ask;
+    uint64_t tryagain;
+    double elapsed;     /* Seconds since redis_cluster_bulk_init */
+} redis_cluster_bulk_stats_st;
+
+typedef struct {
+    redis_cluster_st *cluster;
+    int window;         /* In-flight commands per node */
+    int need_refresh;
+    int inflight;
+    uint64_t seq;
+    uint32_t pass;      /* Retry queue scans */
+    _redis_cluster_bulk_queue nodes[REDIS_CLUSTER_NODE_COUNT];
+    _redis_cluster_bulk_queue retry;    /* By seq within a slot */
+    int held[REDIS_CLUSTER_SLOTS];      /* Commands of the slot queued for retry or resent, new ones wait behind them */
+    char resending[REDIS_CLUSTER_SLOTS];
+    uint32_t seen[REDIS_CLUSTER_SLOTS]; /* Last pass that met the slot */
+    struct timespec start;
+    redis_cluster_bulk_stats_st stats;
+} redis_cluster_bulk_st;
+
+redis_cluster_bulk_st *redis_cluster_bulk_init(redis_cluster_st *cluster, int window);
+void redis_cluster_bulk_free(redis_cluster_bulk_st *bulk);
+/* -1 only when the command was not accepted, send failures are retried and counted by finish */
+int redis_cluster_bulk_add(redis_cluster_bulk_st *bulk, int slot, const char *cmd, size_t len);
+int redis_cluster_bulk_add_argv(redis_cluster_bulk_st *bulk, int argc, const char **argv, const size_t *argvlen);
+int redis_cluster_bulk_finish(redis_cluster_bulk_st *bulk);
+void redis_cluster_bulk_get_stats(redis_cluster_bulk_st *bulk, redis_cluster_bulk_stats_st *stats);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // POCO_REDIS_CLUSTER_H
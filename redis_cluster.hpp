@@ -0,0 +1,330 @@
+#ifndef POCO_REDIS_CLUSTER_HPP
+#define POCO_REDIS_CLUSTER_HPP
+
+/* Header-only C++17 layer over redis_cluster_st.
+ *
+ * Commands are serialized straight to RESP from their arguments, no
+ * format string is parsed. Arguments may be anything convertible to
+ * std::string_view, a char sent as one byte, or integers.
+ */
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "redis_cluster.h"
+
+namespace redis_cluster {
+
+/* Move-only owner of a redisReply */
+class reply {
+public:
+    reply() noexcept = default;
+    explicit reply(redisReply *r) noexcept : r_(r) {}
+    reply(reply &&other) noexcept : r_(std::exchange(other.r_, nullptr)) {}
+    reply &operator=(reply &&other) noexcept
+    {
+        if (this != &other) {
+            reset(std::exchange(other.r_, nullptr));
+        }
+        return *this;
+    }
+    reply(const reply &) = delete;
+    reply &operator=(const reply &) = delete;
+    ~reply() { reset(); }
+
+    void reset(redisReply *r = nullptr) noexcept
+    {
+        if (r_) {
+            freeReplyObject(r_);
+        }
+        r_ = r;
+    }
+    redisReply *release() noexcept { return std::exchange(r_, nullptr); }
+    redisReply *get() const noexcept { return r_; }
+    redisReply *operator->() const noexcept { return r_; }
+    explicit operator bool() const noexcept { return r_ != nullptr; }
+
+    int type() const noexcept { return r_ ? r_->type : 0; }
+    bool is_error() const noexcept { return r_ && REDIS_REPLY_ERROR == r_->type; }
+    bool is_nil() const noexcept { return r_ && REDIS_REPLY_NIL == r_->type; }
+    long long integer() const noexcept { return r_ ? r_->integer : 0; }
+    std::string_view str() const noexcept
+    {
+        return r_ && r_->str ? std::string_view(r_->str, r_->len) : std::string_view();
+    }
+
+private:
+    redisReply *r_ = nullptr;
+};
+
+namespace detail {
+
+constexpr std::size_t decimal_length(std::size_t n) noexcept
+{
+    std::size_t len = 1;
+    while (n >= 10) {
+        n /= 10;
+        ++len;
+    }
+    return len;
+}
+
+/* "*<N>\r\n", built at compile time for every arity in use */
+template <std::size_t N>
+struct array_header {
+    char data[24] = {};
+    std::size_t size = 0;
+
+    constexpr array_header()
+    {
+        std::size_t len = decimal_length(N);
+        std::size_t n = N;
+        data[0] = '*';
+        for (std::size_t i = len; i > 0; --i) {
+            data[i] = static_cast<char>('0' + n % 10);
+            n /= 10;
+        }
+        data[len + 1] = '\r';
+        data[len + 2] = '\n';
+        size = len + 3;
+    }
+};
+
+template <std::size_t N>
+inline constexpr array_header<N> array_header_v{};
+
+/* One command argument viewed as bytes, integers are rendered in place.
+ * Neither copyable nor movable, so the view never points at a stale buffer. */
+class arg {
+public:
+    arg(std::string_view s) noexcept : sv_(s) {}
+    arg(char c) noexcept : buf_{c}, sv_(buf_, 1) {}
+    template <typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool> && !std::is_same_v<T, char>, int> = 0>
+    arg(T v) noexcept
+    {
+        std::to_chars_result r = std::to_chars(buf_, buf_ + sizeof(buf_), v);
+        sv_ = std::string_view(buf_, r.ptr - buf_);
+    }
+    arg(const arg &) = delete;
+    arg &operator=(const arg &) = delete;
+
+    std::string_view view() const noexcept { return sv_; }
+
+private:
+    char buf_[24];
+    std::string_view sv_;
+};
+
+inline char *write_bulk(char *p, std::string_view s) noexcept
+{
+    *p++ = '$';
+    p = std::to_chars(p, p + 20, s.size()).ptr;
+    *p++ = '\r';
+    *p++ = '\n';
+    std::memcpy(p, s.data(), s.size());
+    p += s.size();
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
+}
+
+} // namespace detail
+
+/* Serialize a command into RESP with a single allocation */
+template <typename... Args>
+std::string format_command(Args &&...args)
+{
+    static_assert(sizeof...(Args) > 0, "A command needs at least its name");
+    constexpr const detail::array_header<sizeof...(Args)> &header = detail::array_header_v<sizeof...(Args)>;
+    const detail::arg argv[] = {detail::arg(std::forward<Args>(args))...};
+
+    std::size_t size = header.size;
+    for (const detail::arg &a : argv) {
+        size += 1 + detail::decimal_length(a.view().size()) + 2 + a.view().size() + 2;
+    }
+
+    std::string cmd;
+    cmd.resize(size);
+    char *p = cmd.data();
+    std::memcpy(p, header.data, header.size);
+    p += header.size;
+    for (const detail::arg &a : argv) {
+        p = detail::write_bulk(p, a.view());
+    }
+    return cmd;
+}
+
+inline int keyslot(std::string_view key) noexcept
+{
+    return redis_cluster_keyslot(key.data(), key.size());
+}
+
+namespace detail {
+
+/* Slot of key, also offered to the hot key sampler when it is on */
+inline int sampled_keyslot(redis_cluster_st *c, std::string_view key) noexcept
+{
+    int slot = keyslot(key);
+    redis_cluster_traffic_key(c, slot, key.data(), key.size());
+    return slot;
+}
+
+} // namespace detail
+
+/* RAII handle of a redis_cluster_st, throws std::bad_alloc when it cannot be created */
+class cluster {
+public:
+    cluster() : c_(redis_cluster_init())
+    {
+        if (!c_) {
+            throw std::bad_alloc();
+        }
+    }
+    cluster(cluster &&other) noexcept : c_(std::exchange(other.c_, nullptr)) {}
+    cluster &operator=(cluster &&other) noexcept
+    {
+        if (this != &other) {
+            if (c_) {
+                redis_cluster_free(c_);
+            }
+            c_ = std::exchange(other.c_, nullptr);
+        }
+        return *this;
+    }
+    cluster(const cluster &) = delete;
+    cluster &operator=(const cluster &) = delete;
+    ~cluster()
+    {
+        if (c_) {
+            redis_cluster_free(c_);
+        }
+    }
+
+    bool connect(const std::vector<std::pair<std::string, int>> &seeds, int timeout_ms)
+    {
+        if (!c_) {
+            return false;
+        }
+        std::vector<std::array<char, 64>> ips(seeds.size());
+        std::vector<int> ports(seeds.size());
+        for (std::size_t i = 0; i < seeds.size(); ++i) {
+            std::snprintf(ips[i].data(), ips[i].size(), "%s", seeds[i].first.c_str());
+            ports[i] = seeds[i].second;
+        }
+        return 0 == redis_cluster_connect(c_, reinterpret_cast<const char (*)[64]>(ips.data()), ports.data(),
+                static_cast<int>(seeds.size()), timeout_ms);
+    }
+
+    redis_cluster_st *get() const noexcept { return c_; }
+    const char *errstr() const noexcept { return c_ ? c_->errstr : nullptr; }
+
+    /* Run one command, key only selects the slot */
+    template <typename... Args>
+    reply execute(std::string_view key, Args &&...args)
+    {
+        std::string cmd = format_command(std::forward<Args>(args)...);
+        return reply(redis_cluster_formatted_execute(c_, detail::sampled_keyslot(c_, key), cmd.data(), cmd.size()));
+    }
+
+private:
+    redis_cluster_st *c_;
+};
+
+/* Commands sent as they are appended, replies read back in append order.
+ * Uses the append/get_reply machinery of the cluster, so it must not be
+ * interleaved with other appends on the same cluster or used in stream mode. */
+class pipeline {
+public:
+    explicit pipeline(cluster &c) noexcept : c_(c.get()) {}
+    pipeline(const pipeline &) = delete;
+    pipeline &operator=(const pipeline &) = delete;
+    ~pipeline()
+    {
+        /* Replies still owed are read so the connections stay in sync */
+        while (!cmds_.empty()) {
+            get_reply();
+        }
+    }
+
+    template <typename... Args>
+    bool append(std::string_view key, Args &&...args)
+    {
+        /* deque never moves its elements, the buffers stay valid for redirects */
+        cmds_.push_back(format_command(std::forward<Args>(args)...));
+        const std::string &cmd = cmds_.back();
+        if (redis_cluster_formatted_append(c_, detail::sampled_keyslot(c_, key), cmd.data(), cmd.size()) < 0) {
+            cmds_.pop_back();
+            return false;
+        }
+        return true;
+    }
+
+    reply get_reply()
+    {
+        if (cmds_.empty()) {
+            return reply();
+        }
+        reply r(redis_cluster_get_reply(c_));
+        cmds_.pop_front();
+        return r;
+    }
+
+    std::size_t pending() const noexcept { return cmds_.size(); }
+
+private:
+    redis_cluster_st *c_;
+    std::deque<std::string> cmds_;
+};
+
+/* Commands collected first and sent together by exec() */
+class batch {
+public:
+    explicit batch(cluster &c) noexcept : c_(c.get()) {}
+
+    template <typename... Args>
+    batch &add(std::string_view key, Args &&...args)
+    {
+        cmds_.push_back(format_command(std::forward<Args>(args)...));
+        slots_.push_back(detail::sampled_keyslot(c_, key));
+        return *this;
+    }
+
+    /* One reply per command, empty where it failed */
+    std::vector<reply> exec()
+    {
+        std::vector<reply> replies(cmds_.size());
+        std::vector<bool> appended(cmds_.size());
+        for (std::size_t i = 0; i < cmds_.size(); ++i) {
+            appended[i] = redis_cluster_formatted_append(c_, slots_[i], cmds_[i].data(), cmds_[i].size()) >= 0;
+        }
+        for (std::size_t i = 0; i < cmds_.size(); ++i) {
+            if (appended[i]) {
+                replies[i].reset(redis_cluster_get_reply(c_));
+            }
+        }
+        cmds_.clear();
+        slots_.clear();
+        return replies;
+    }
+
+    std::size_t size() const noexcept { return cmds_.size(); }
+
+private:
+    redis_cluster_st *c_;
+    std::deque<std::string> cmds_;
+    std::vector<int> slots_;
+};
+
+} // namespace redis_cluster
+
+#endif // POCO_REDIS_CLUSTER_HPP
@@ -0,0 +1,485 @@
+#include "redis_cluster.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Large values
+ *
+ * GET payloads are received straight into caller memory and SET values
+ * are gathered from caller buffers by the kernel, neither goes through
+ * the hiredis buffers. The raw socket is only in sync when nothing else is
+ * in flight on the node, so pipelined appends must have been read first. */
+
+/* Header buffer, also the chunk size of streamed reads */
+#define _BLOB_BUF_SIZE (64 * 1024)
+#define _BLOB_IOV_MAX 64
+
+typedef struct {
+    char buf[_BLOB_BUF_SIZE];
+    size_t pos;
+    size_t len;
+} _redis_cluster_blob_in;
+
+static const char _redis_cluster_blob_asking[] = "*1\r\n$6\r\nASKING\r\n";
+
+static int _redis_cluster_blob_fail(redis_cluster_st *cluster, redis_cluster_node_st *node, const char *errstr)
+{
+    cluster->errstr = errstr;
+    if (node->ctx) {
+        redisFree(node->ctx);
+        node->ctx = NULL;
+    }
+    node->pending = 0;
+    return -1;
+}
+
+static ssize_t _redis_cluster_blob_recv(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+    do {
+        n = recv(fd, buf, len, 0);
+    } while (n < 0 && EINTR == errno);
+    return n;
+}
+
+/* Next header line with its CRLF replaced by a NUL */
+static char *_redis_cluster_blob_line(int fd, _redis_cluster_blob_in *in)
+{
+    char *line;
+    char *end;
+    ssize_t n;
+
+    for (;;) {
+        line = in->buf + in->pos;
+        end = (char *)memchr(line, '\n', in->len - in->pos);
+        if (end) {
+            if (end == line || '\r' != end[-1]) {
+                return NULL;
+            }
+            end[-1] = '\0';
+            in->pos = end + 1 - in->buf;
+            return line;
+        }
+
+        if (in->pos > 0) {
+            memmove(in->buf, line, in->len - in->pos);
+            in->len -= in->pos;
+            in->pos = 0;
+        }
+        if (in->len == sizeof(in->buf)) {
+            return NULL;
+        }
+        n = _redis_cluster_blob_recv(fd, in->buf + in->len, sizeof(in->buf) - in->len);
+        if (n <= 0) {
+            return NULL;
+        }
+        in->len += n;
+    }
+}
+
+/* Read and drop len bytes, first those left over from the header */
+static int _redis_cluster_blob_skip(int fd, _redis_cluster_blob_in *in, size_t len)
+{
+    size_t n = in->len - in->pos < len ? in->len - in->pos : len;
+    ssize_t r;
+
+    in->pos += n;
+    len -= n;
+    while (len > 0) {
+        r = _redis_cluster_blob_recv(fd, in->buf, len < sizeof(in->buf) ? len : sizeof(in->buf));
+        if (r <= 0) {
+            return -1;
+        }
+        len -= r;
+    }
+    return 0;
+}
+
+static int _redis_cluster_blob_send(int fd, struct iovec *vec, int count)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    while (count > 0) {
+        memset(&msg, 0x00, sizeof(msg));
+        msg.msg_iov = vec;
+        msg.msg_iovlen = count;
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= vec->iov_len) {
+            n -= vec->iov_len;
+            ++vec;
+            --count;
+        }
+        if (count > 0) {
+            vec->iov_base = (char *)vec->iov_base + n;
+            vec->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Node for the slot, usable only when no pipelined reply is owed */
+static redis_cluster_node_st *_redis_cluster_blob_node(redis_cluster_st *cluster, redis_cluster_node_st *node)
+{
+    if (!node) {
+        return NULL;
+    }
+    if (!node->ctx && _redis_cluster_node_connect(cluster, node) < 0) {
+        cluster->errstr = "Connect fail";
+        return NULL;
+    }
+    if (_redis_cluster_noreply_skip(cluster) < 0 || _redis_cluster_discard_orphans(cluster, node) < 0) {
+        cluster->errstr = "Get reply fail";
+        return NULL;
+    }
+    if (node->pending > 0 || sdslen(node->ctx->obuf) > 0 || node->ctx->reader->pos < node->ctx->reader->len) {
+        cluster->errstr = "Pipelined replies pending";
+        return NULL;
+    }
+    return node;
+}
+
+/* Next node to try after an error reply, NULL when the error is final.
+ * The hop span runs up to a usable node, backoff and reconnect included. */
+static redis_cluster_node_st *_redis_cluster_blob_redirect(redis_cluster_st *cluster, int slot, const char *err,
+        int *asking, int *attempt, int *redirects)
+{
+    struct timespec span_ts = {0, 0};
+    redis_cluster_node_st *node = NULL;
+    redisReply reply;
+    char ip[64];
+    int port;
+    int redirect_slot;
+    int hop_type;
+    int idx;
+
+    memset(&reply, 0x00, sizeof(reply));
+    reply.type = REDIS_REPLY_ERROR;
+    reply.str = (char *)err;
+    reply.len = strlen(err);
+
+    *asking = 0;
+    switch (_redis_cluster_error_class(&reply)) {
+    case REDIS_CLUSTER_ERR_MOVED:
+    case REDIS_CLUSTER_ERR_ASK:
+        if (++*redirects > REDIS_CLUSTER_MAX_REDIRECTS) {
+            return NULL;
+        }
+        hop_type = REDIS_CLUSTER_SPAN_REDIRECT;
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, hop_type, slot);
+        idx = _redis_cluster_redirect_target(err, &redirect_slot, ip, sizeof(ip), &port) < 0 ? -1 : _redis_cluster_find_connection(cluster, ip, port);
+        if (idx < 0) {
+            if (_redis_cluster_refresh(cluster) < 0) {
+                goto ON_HOP_END;
+            }
+        } else if (REDIS_CLUSTER_ERR_ASK == _redis_cluster_error_class(&reply)) {
+            *asking = 1;
+            node = _redis_cluster_blob_node(cluster, cluster->redis_nodes[idx]);
+            goto ON_HOP_END;
+        } else {
+            _redis_cluster_set_slot(cluster, cluster->redis_nodes[idx], slot);
+        }
+        break;
+    case REDIS_CLUSTER_ERR_CLUSTERDOWN:
+    case REDIS_CLUSTER_ERR_TRYAGAIN:
+    case REDIS_CLUSTER_ERR_LOADING:
+        hop_type = REDIS_CLUSTER_SPAN_RETRY;
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, hop_type, slot);
+        if (_redis_cluster_retry_wait(cluster, (*attempt)++) < 0) {
+            goto ON_HOP_END;
+        }
+        break;
+    default:
+        return NULL;
+    }
+
+    node = _redis_cluster_blob_node(cluster, _redis_cluster_slot_node(cluster, slot));
+
+ON_HOP_END:
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, hop_type, slot, node, node ? 0 : -1);
+    return node;
+}
+
+/* Send GET and read up to the bulk length, the payload is left on the socket.
+ * Returns its length, REDIS_CLUSTER_NIL or -1. */
+static long long _redis_cluster_blob_get(redis_cluster_st *cluster, const char *key, _redis_cluster_blob_in *in,
+        redis_cluster_node_st **out)
+{
+    size_t klen = strlen(key);
+    int slot = redis_cluster_keyslot(key, klen);
+    int asking = 0;
+    int attempt = 0;
+    int redirects = 0;
+    redis_cluster_node_st *node;
+    struct timespec span_ts = {0, 0};
+    char *line;
+    int done;
+    int rc;
+
+    cluster->trace_current = ++cluster->trace_seq;
+    _redis_cluster_traffic_key(cluster, slot, key, klen);
+    _redis_cluster_traffic_slot(cluster, slot);
+
+    node = _redis_cluster_blob_node(cluster, _redis_cluster_slot_node(cluster, slot));
+    while (node) {
+        if ((asking && REDIS_OK != redisAppendFormattedCommand(node->ctx, _redis_cluster_blob_asking, sizeof(_redis_cluster_blob_asking) - 1))
+                || REDIS_OK != redisAppendCommand(node->ctx, "GET %b", key, klen)) {
+            return _redis_cluster_blob_fail(cluster, node, "Append command fail");
+        }
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, slot);
+        do {
+            rc = redisBufferWrite(node->ctx, &done);
+        } while (REDIS_OK == rc && !done);
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, slot, node, REDIS_OK == rc ? 0 : -1);
+        if (REDIS_OK != rc) {
+            return _redis_cluster_blob_fail(cluster, node, "Send fail");
+        }
+
+        /* Up to the bulk length, the payload is timed by the caller */
+        in->pos = 0;
+        in->len = 0;
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot);
+        if (asking && (!(line = _redis_cluster_blob_line(node->ctx->fd, in)) || '+' != line[0])) {
+            _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, -1);
+            return _redis_cluster_blob_fail(cluster, node, "ASKING fail");
+        }
+        line = _redis_cluster_blob_line(node->ctx->fd, in);
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, line ? 0 : -1);
+        if (!line) {
+            return _redis_cluster_blob_fail(cluster, node, "Receive fail");
+        }
+
+        if ('$' == line[0]) {
+            *out = node;
+            return '-' == line[1] ? REDIS_CLUSTER_NIL : strtoll(line + 1, NULL, 10);
+        }
+        if ('-' != line[0]) {
+            return _redis_cluster_blob_fail(cluster, node, "Unexpected reply");
+        }
+
+        /* The connection is still in sync after an error line */
+        snprintf(node->ctx->errstr, sizeof(node->ctx->errstr), "%s", line + 1);
+        cluster->errstr = node->ctx->errstr;
+        node = _redis_cluster_blob_redirect(cluster, slot, line + 1, &asking, &attempt, &redirects);
+    }
+
+    return -1;
+}
+
+long long redis_cluster_get_into(redis_cluster_st *cluster, const char *key, char *buf, size_t cap)
+{
+    if (!cluster || !key || (!buf && cap > 0)) {
+        return -1;
+    }
+
+    _redis_cluster_blob_in in;
+    redis_cluster_node_st *node = NULL;
+    long long size = _redis_cluster_blob_get(cluster, key, &in, &node);
+    struct timespec span_ts = {0, 0};
+    int slot;
+    size_t want;
+    size_t got;
+    ssize_t n;
+
+    if (size < 0) {
+        return size;
+    }
+
+    /* Bytes that came with the header, then the rest straight from the socket */
+    slot = redis_cluster_keyslot(key, strlen(key));
+    _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot);
+    want = (size_t)size < cap ? (size_t)size : cap;
+    got = in.len - in.pos < want ? in.len - in.pos : want;
+    memcpy(buf, in.buf + in.pos, got);
+    in.pos += got;
+    while (got < want) {
+        n = _redis_cluster_blob_recv(node->ctx->fd, buf + got, want - got);
+        if (n <= 0) {
+            _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, -1);
+            return _redis_cluster_blob_fail(cluster, node, "Receive fail");
+        }
+        got += n;
+    }
+
+    /* What did not fit and the trailing CRLF */
+    if (_redis_cluster_blob_skip(node->ctx->fd, &in, size - want + 2) < 0) {
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, -1);
+        return _redis_cluster_blob_fail(cluster, node, "Receive fail");
+    }
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, 0);
+
+    cluster->errstr = NULL;
+    return size;
+}
+
+long long redis_cluster_get_stream(redis_cluster_st *cluster, const char *key, redis_cluster_chunk_cb cb, void *privdata)
+{
+    if (!cluster || !key || !cb) {
+        return -1;
+    }
+
+    _redis_cluster_blob_in in;
+    redis_cluster_node_st *node = NULL;
+    long long size = _redis_cluster_blob_get(cluster, key, &in, &node);
+    struct timespec span_ts = {0, 0};
+    int slot;
+    size_t left;
+    size_t n;
+    ssize_t r;
+
+    if (size < 0) {
+        return size;
+    }
+
+    slot = redis_cluster_keyslot(key, strlen(key));
+    _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot);
+    left = (size_t)size;
+    n = in.len - in.pos < left ? in.len - in.pos : left;
+    while (left > 0) {
+        if (0 == n) {
+            r = _redis_cluster_blob_recv(node->ctx->fd, in.buf, left < sizeof(in.buf) ? left : sizeof(in.buf));
+            if (r <= 0) {
+                _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, -1);
+                return _redis_cluster_blob_fail(cluster, node, "Receive fail");
+            }
+            in.pos = 0;
+            in.len = r;
+            n = r;
+        }
+        left -= n;
+        if (0 != cb(cluster, in.buf + in.pos, n, (size_t)size, privdata)) {
+            /* Rest of the payload is still on the wire */
+            _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, -1);
+            return _redis_cluster_blob_fail(cluster, node, "Aborted by callback");
+        }
+        in.pos += n;
+        n = 0;
+    }
+
+    if (_redis_cluster_blob_skip(node->ctx->fd, &in, 2) < 0) {
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, -1);
+        return _redis_cluster_blob_fail(cluster, node, "Receive fail");
+    }
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, 0);
+
+    cluster->errstr = NULL;
+    return size;
+}
+
+int redis_cluster_setv(redis_cluster_st *cluster, const char *key, const struct iovec *iov, int iovcnt)
+{
+    if (!cluster || !key || iovcnt < 0 || iovcnt > _BLOB_IOV_MAX - 3 || (!iov && iovcnt > 0)) {
+        return -1;
+    }
+
+    struct iovec vec[_BLOB_IOV_MAX];
+    size_t klen = strlen(key);
+    int slot = redis_cluster_keyslot(key, klen);
+    size_t vlen = 0;
+    char *head;
+    int head_len;
+    int asking = 0;
+    int attempt = 0;
+    int redirects = 0;
+    redis_cluster_node_st *node;
+    struct timespec span_ts = {0, 0};
+    redisReply *reply;
+    int count;
+    int status;
+    int rc = -1;
+    int i;
+
+    for (i = 0; i < iovcnt; ++i) {
+        vlen += iov[i].iov_len;
+    }
+
+    /* Only the command header is formatted, the value is never copied */
+    head = (char *)malloc(klen + 64);
+    if (!head) {
+        return -1;
+    }
+    head_len = snprintf(head, klen + 64, "*3\r\n$3\r\nSET\r\n$%zu\r\n", klen);
+    memcpy(head + head_len, key, klen);
+    head_len += klen;
+    head_len += snprintf(head + head_len, klen + 64 - head_len, "\r\n$%zu\r\n", vlen);
+
+    cluster->trace_current = ++cluster->trace_seq;
+    _redis_cluster_traffic_key(cluster, slot, key, klen);
+    _redis_cluster_traffic_slot(cluster, slot);
+
+    node = _redis_cluster_blob_node(cluster, _redis_cluster_slot_node(cluster, slot));
+    while (node) {
+        count = 0;
+        if (asking) {
+            vec[count].iov_base = (void *)_redis_cluster_blob_asking;
+            vec[count++].iov_len = sizeof(_redis_cluster_blob_asking) - 1;
+        }
+        vec[count].iov_base = head;
+        vec[count++].iov_len = head_len;
+        for (i = 0; i < iovcnt; ++i) {
+            vec[count++] = iov[i];
+        }
+        vec[count].iov_base = (void *)"\r\n";
+        vec[count++].iov_len = 2;
+
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, slot);
+        status = _redis_cluster_blob_send(node->ctx->fd, vec, count);
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, slot, node, status);
+        if (status < 0) {
+            _redis_cluster_blob_fail(cluster, node, "Send fail");
+            break;
+        }
+
+        reply = NULL;
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot);
+        if (asking) {
+            if (REDIS_OK != redisGetReply(node->ctx, (void **)&reply)) {
+                _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, -1);
+                _redis_cluster_blob_fail(cluster, node, "ASKING fail");
+                break;
+            }
+            freeReplyObject(reply);
+            reply = NULL;
+        }
+        status = redisGetReply(node->ctx, (void **)&reply);
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, slot, node, REDIS_OK == status ? 0 : -1);
+        if (REDIS_OK != status) {
+            _redis_cluster_blob_fail(cluster, node, "Receive fail");
+            break;
+        }
+
+        if (REDIS_REPLY_ERROR != reply->type) {
+            cluster->errstr = NULL;
+            freeReplyObject(reply);
+            rc = 0;
+            break;
+        }
+        snprintf(node->ctx->errstr, sizeof(node->ctx->errstr), "%s", reply->str);
+        cluster->errstr = node->ctx->errstr;
+        node = _redis_cluster_blob_redirect(cluster, slot, reply->str, &asking, &attempt, &redirects);
+        freeReplyObject(reply);
+    }
+
+    free(head);
+    return rc;
+}
+
+int redis_cluster_set_from(redis_cluster_st *cluster, const char *key, const char *buf, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return redis_cluster_setv(cluster, key, &iov, 1);
+}
@@ -0,0 +1,553 @@
+#include "redis_cluster.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <poll.h>
+
+#define DEFAULT_BULK_WINDOW 128
+
+static const char _redis_cluster_asking_cmd[] = "*1\r\n$6\r\nASKING\r\n";
+
+static void _redis_cluster_bulk_push(_redis_cluster_bulk_queue *queue, _redis_cluster_bulk_cmd *c)
+{
+    c->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = c;
+    } else {
+        queue->head = c;
+    }
+    queue->tail = c;
+    ++queue->count;
+}
+
+static _redis_cluster_bulk_cmd *_redis_cluster_bulk_pop(_redis_cluster_bulk_queue *queue)
+{
+    _redis_cluster_bulk_cmd *c = queue->head;
+    if (!c) {
+        return NULL;
+    }
+
+    queue->head = c->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    --queue->count;
+    return c;
+}
+
+/* Behind the commands of the same slot added before c */
+static void _redis_cluster_bulk_insert(_redis_cluster_bulk_queue *queue, _redis_cluster_bulk_cmd *c)
+{
+    _redis_cluster_bulk_cmd **link = &queue->head;
+
+    while (*link && ((*link)->slot != c->slot || (*link)->seq < c->seq)) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        _redis_cluster_bulk_push(queue, c);
+        return;
+    }
+    c->next = *link;
+    *link = c;
+    ++queue->count;
+}
+
+static void _redis_cluster_bulk_cmd_free(_redis_cluster_bulk_cmd *c)
+{
+    free(c->cmd);
+    free(c);
+}
+
+static void _redis_cluster_bulk_queue_free(_redis_cluster_bulk_queue *queue)
+{
+    _redis_cluster_bulk_cmd *c;
+    while ((c = _redis_cluster_bulk_pop(queue))) {
+        _redis_cluster_bulk_cmd_free(c);
+    }
+}
+
+static int _redis_cluster_bulk_due(const _redis_cluster_bulk_cmd *c, const struct timespec *now)
+{
+    return now->tv_sec > c->not_before.tv_sec ||
+        (now->tv_sec == c->not_before.tv_sec && now->tv_nsec >= c->not_before.tv_nsec);
+}
+
+/* Answered or given up, later commands of its slot may go */
+static void _redis_cluster_bulk_done(redis_cluster_bulk_st *bulk, _redis_cluster_bulk_cmd *c)
+{
+    if (c->held) {
+        --bulk->held[c->slot];
+    }
+    _redis_cluster_bulk_cmd_free(c);
+}
+
+/* Queue a command for another attempt after delay_ms, or give up on it */
+static void _redis_cluster_bulk_retry(redis_cluster_bulk_st *bulk, _redis_cluster_bulk_cmd *c, int delay_ms)
+{
+    if (++c->attempts >= REDIS_CLUSTER_BULK_MAX_ATTEMPTS) {
+        ++bulk->stats.errors;
+        _redis_cluster_bulk_done(bulk, c);
+        return;
+    }
+    if (!c->held) {
+        c->held = 1;
+        ++bulk->held[c->slot];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &c->not_before);
+    c->not_before.tv_sec += delay_ms / 1000;
+    c->not_before.tv_nsec += (long)(delay_ms % 1000) * 1000000;
+    if (c->not_before.tv_nsec >= 1000000000) {
+        c->not_before.tv_sec += 1;
+        c->not_before.tv_nsec -= 1000000000;
+    }
+    _redis_cluster_bulk_insert(&bulk->retry, c);
+}
+
+static int _redis_cluster_bulk_backoff(int attempts)
+{
+    int delay = 10 << (attempts < 7 ? attempts : 7);
+    return delay < 1000 ? delay : 1000;
+}
+
+/* Connection lost, everything in flight on it goes back to the retry queue */
+static void _redis_cluster_bulk_node_fail(redis_cluster_bulk_st *bulk, int id)
+{
+    redis_cluster_node_st *cluster_node = bulk->cluster->redis_nodes[id];
+    _redis_cluster_bulk_cmd *c;
+
+    if (cluster_node->ctx) {
+        redisFree(cluster_node->ctx);
+        cluster_node->ctx = NULL;
+    }
+    cluster_node->pending = 0;
+
+    while ((c = _redis_cluster_bulk_pop(&bulk->nodes[id]))) {
+        if (c->asking) {
+            _redis_cluster_bulk_cmd_free(c);
+            continue;
+        }
+        --bulk->inflight;
+        if (c->held) {
+            bulk->resending[c->slot] = 0;
+        }
+        c->ask_node = -1;
+        _redis_cluster_bulk_retry(bulk, c, _redis_cluster_bulk_backoff(c->attempts));
+    }
+    bulk->need_refresh = 1;
+}
+
+static void _redis_cluster_bulk_on_reply(redis_cluster_bulk_st *bulk, int id, redisReply *reply)
+{
+    _redis_cluster_bulk_cmd *c = _redis_cluster_bulk_pop(&bulk->nodes[id]);
+    char ip[64];
+    int port;
+    int slot;
+    int idx;
+
+    if (!c) {
+        return;
+    }
+    --bulk->cluster->redis_nodes[id]->pending;
+    if (c->asking) {
+        /* +OK of ASKING, the command after it carries the real reply */
+        _redis_cluster_bulk_cmd_free(c);
+        return;
+    }
+    --bulk->inflight;
+    if (c->held) {
+        bulk->resending[c->slot] = 0;
+    }
+
+    switch (_redis_cluster_error_class(reply)) {
+    case REDIS_CLUSTER_ERR_NONE:
+        ++bulk->stats.replies;
+        _redis_cluster_bulk_done(bulk, c);
+        break;
+
+    case REDIS_CLUSTER_ERR_MOVED:
+    case REDIS_CLUSTER_ERR_ASK:
+        c->ask_node = -1;
+        idx = -1;
+        if (0 == _redis_cluster_redirect_target(reply->str, &slot, ip, sizeof(ip), &port)) {
+            idx = _redis_cluster_find_connection(bulk->cluster, ip, port);
+        }
+        if (REDIS_CLUSTER_ERR_MOVED == _redis_cluster_error_class(reply)) {
+            ++bulk->stats.moved;
+            if (idx >= 0) {
+                _redis_cluster_set_slot(bulk->cluster, bulk->cluster->redis_nodes[idx], c->slot);
+            }
+        } else {
+            ++bulk->stats.ask;
+            c->ask_node = idx;
+        }
+        if (idx < 0) {
+            bulk->need_refresh = 1;
+        }
+        _redis_cluster_bulk_retry(bulk, c, 0);
+        break;
+
+    case REDIS_CLUSTER_ERR_CLUSTERDOWN:
+        bulk->need_refresh = 1;
+        /* fall through */
+    case REDIS_CLUSTER_ERR_TRYAGAIN:
+    case REDIS_CLUSTER_ERR_LOADING:
+        ++bulk->stats.tryagain;
+        _redis_cluster_bulk_retry(bulk, c, _redis_cluster_bulk_backoff(c->attempts));
+        break;
+
+    default:
+        ++bulk->stats.replies;
+        ++bulk->stats.errors;
+        _redis_cluster_bulk_done(bulk, c);
+        break;
+    }
+}
+
+/* Flush every node with commands in flight and read what has arrived,
+ * waiting up to the cluster timeout for the first reply. */
+static int _redis_cluster_bulk_pump(redis_cluster_bulk_st *bulk)
+{
+    redis_cluster_st *cluster = bulk->cluster;
+    struct pollfd pfds[REDIS_CLUSTER_NODE_COUNT];
+    int ids[REDIS_CLUSTER_NODE_COUNT];
+    int timeout_ms = cluster->timeout.tv_sec * 1000 + cluster->timeout.tv_usec / 1000;
+    struct timespec span_ts = {0, 0};
+    redisReply *reply;
+    int done;
+    int rc;
+    int n = 0;
+    int i;
+
+    /* Spans of many commands at once */
+    cluster->trace_current = 0;
+    for (i = 0; i < cluster->node_count; ++i) {
+        if (0 == bulk->nodes[i].count) {
+            continue;
+        }
+        if (!cluster->redis_nodes[i]->ctx) {
+            _redis_cluster_bulk_node_fail(bulk, i);
+            continue;
+        }
+
+        done = 0;
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, -1);
+        while (!done) {
+            if (REDIS_OK != redisBufferWrite(cluster->redis_nodes[i]->ctx, &done)) {
+                break;
+            }
+        }
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, -1, cluster->redis_nodes[i], done ? 0 : -1);
+        if (!done) {
+            _redis_cluster_bulk_node_fail(bulk, i);
+            continue;
+        }
+
+        pfds[n].fd = cluster->redis_nodes[i]->ctx->fd;
+        pfds[n].events = POLLIN;
+        pfds[n].revents = 0;
+        ids[n] = i;
+        ++n;
+    }
+    if (0 == n) {
+        return 0;
+    }
+
+    _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, -1);
+    rc = poll(pfds, n, timeout_ms);
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, -1, 1 == n ? cluster->redis_nodes[ids[0]] : NULL, rc > 0 ? 0 : -1);
+    if (rc < 0) {
+        return EINTR == errno ? 0 : -1;
+    }
+    if (0 == rc) {
+        /* Nobody answered in time */
+        for (i = 0; i < n; ++i) {
+            _redis_cluster_bulk_node_fail(bulk, ids[i]);
+        }
+        return 0;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (!pfds[i].revents) {
+            continue;
+        }
+        if (REDIS_OK != redisBufferRead(cluster->redis_nodes[ids[i]]->ctx)) {
+            _redis_cluster_bulk_node_fail(bulk, ids[i]);
+            continue;
+        }
+
+        for (;;) {
+            reply = NULL;
+            if (REDIS_OK != redisGetReplyFromReader(cluster->redis_nodes[ids[i]]->ctx, (void **)&reply)) {
+                _redis_cluster_bulk_node_fail(bulk, ids[i]);
+                break;
+            }
+            if (!reply) {
+                break;
+            }
+            _redis_cluster_bulk_on_reply(bulk, ids[i], reply);
+            freeReplyObject(reply);
+        }
+    }
+
+    return 0;
+}
+
+static int _redis_cluster_bulk_send(redis_cluster_bulk_st *bulk, _redis_cluster_bulk_cmd *c)
+{
+    redis_cluster_st *cluster = bulk->cluster;
+    redis_cluster_node_st *cluster_node;
+    _redis_cluster_bulk_cmd *marker;
+
+    if (c->ask_node >= 0 && c->ask_node < cluster->node_count) {
+        cluster_node = cluster->redis_nodes[c->ask_node];
+    } else {
+        cluster_node = cluster->slots_handler[c->slot];
+    }
+    if (!cluster_node || (!cluster_node->ctx && _redis_cluster_node_connect(cluster, cluster_node) < 0)) {
+        bulk->need_refresh = 1;
+        _redis_cluster_bulk_retry(bulk, c, _redis_cluster_bulk_backoff(c->attempts));
+        return 0;
+    }
+
+    /* Window full, make room by reading replies */
+    while (bulk->nodes[cluster_node->id].count >= bulk->window) {
+        if (_redis_cluster_bulk_pump(bulk) < 0) {
+            _redis_cluster_bulk_retry(bulk, c, _redis_cluster_bulk_backoff(c->attempts));
+            return -1;
+        }
+    }
+    if (!cluster_node->ctx) {
+        _redis_cluster_bulk_retry(bulk, c, _redis_cluster_bulk_backoff(c->attempts));
+        return 0;
+    }
+
+    if (c->ask_node >= 0) {
+        marker = (_redis_cluster_bulk_cmd *)calloc(1, sizeof(_redis_cluster_bulk_cmd));
+        if (!marker || REDIS_OK != redisAppendFormattedCommand(cluster_node->ctx, _redis_cluster_asking_cmd, sizeof(_redis_cluster_asking_cmd) - 1)) {
+            free(marker);
+            _redis_cluster_bulk_retry(bulk, c, 0);
+            return 0;
+        }
+        marker->asking = 1;
+        _redis_cluster_bulk_push(&bulk->nodes[cluster_node->id], marker);
+        ++cluster_node->pending;
+    }
+
+    if (REDIS_OK != redisAppendFormattedCommand(cluster_node->ctx, c->cmd, c->len)) {
+        _redis_cluster_bulk_retry(bulk, c, 0);
+        _redis_cluster_bulk_node_fail(bulk, cluster_node->id);
+        return 0;
+    }
+    _redis_cluster_bulk_push(&bulk->nodes[cluster_node->id], c);
+    ++cluster_node->pending;
+    ++bulk->inflight;
+    if (c->held) {
+        bulk->resending[c->slot] = 1;
+    }
+    return 0;
+}
+
+/* Refresh once nothing is in flight, then resend retries that are due */
+static int _redis_cluster_bulk_service(redis_cluster_bulk_st *bulk)
+{
+    _redis_cluster_bulk_queue due;
+    _redis_cluster_bulk_cmd *c;
+    struct timespec now;
+
+    if (bulk->need_refresh) {
+        /* Node ids change on refresh, drain the node queues first */
+        while (bulk->inflight > 0) {
+            if (_redis_cluster_bulk_pump(bulk) < 0) {
+                return -1;
+            }
+        }
+        bulk->need_refresh = 0;
+        _redis_cluster_refresh(bulk->cluster);
+        for (c = bulk->retry.head; c; c = c->next) {
+            c->ask_node = -1;
+        }
+    }
+
+    due = bulk->retry;
+    memset(&bulk->retry, 0x00, sizeof(bulk->retry));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ++bulk->pass;
+    while ((c = _redis_cluster_bulk_pop(&due))) {
+        /* The oldest of a slot goes first, alone, and the others wait for its reply */
+        if (bulk->seen[c->slot] == bulk->pass || bulk->resending[c->slot] || !_redis_cluster_bulk_due(c, &now)) {
+            bulk->seen[c->slot] = bulk->pass;
+            /* A send below may pump and requeue older commands of the slot */
+            _redis_cluster_bulk_insert(&bulk->retry, c);
+            continue;
+        }
+        bulk->seen[c->slot] = bulk->pass;
+        if (_redis_cluster_bulk_send(bulk, c) < 0) {
+            while ((c = _redis_cluster_bulk_pop(&due))) {
+                _redis_cluster_bulk_insert(&bulk->retry, c);
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+redis_cluster_bulk_st *redis_cluster_bulk_init(redis_cluster_st *cluster, int window)
+{
+    if (!cluster) {
+        return NULL;
+    }
+
+    /* Replies left behind by hedged reads or no-reply commands would be taken for ours */
+    redis_cluster_noreply_drain(cluster);
+    if (cluster->bulk_active || (cluster->slot_list && cluster->slot_list->pos < cluster->slot_list->count)) {
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < cluster->node_count; ++i) {
+        _redis_cluster_discard_orphans(cluster, cluster->redis_nodes[i]);
+    }
+
+    redis_cluster_bulk_st *bulk = (redis_cluster_bulk_st *)calloc(1, sizeof(redis_cluster_bulk_st));
+    if (!bulk) {
+        return NULL;
+    }
+
+    cluster->bulk_active = 1;
+    bulk->cluster = cluster;
+    bulk->window = window > 0 ? window : DEFAULT_BULK_WINDOW;
+    clock_gettime(CLOCK_MONOTONIC, &bulk->start);
+    return bulk;
+}
+
+void redis_cluster_bulk_free(redis_cluster_bulk_st *bulk)
+{
+    if (!bulk) {
+        return;
+    }
+    int i;
+
+    /* Connections with unread replies cannot be reused */
+    for (i = 0; i < REDIS_CLUSTER_NODE_COUNT; ++i) {
+        if (bulk->nodes[i].count > 0 && i < bulk->cluster->node_count && bulk->cluster->redis_nodes[i]->ctx) {
+            redisFree(bulk->cluster->redis_nodes[i]->ctx);
+            bulk->cluster->redis_nodes[i]->ctx = NULL;
+            bulk->cluster->redis_nodes[i]->pending = 0;
+        }
+        _redis_cluster_bulk_queue_free(&bulk->nodes[i]);
+    }
+    _redis_cluster_bulk_queue_free(&bulk->retry);
+    bulk->cluster->bulk_active = 0;
+    free(bulk);
+}
+
+int redis_cluster_bulk_add(redis_cluster_bulk_st *bulk, int slot, const char *cmd, size_t len)
+{
+    if (!bulk || slot < 0 || slot >= REDIS_CLUSTER_SLOTS || !cmd) {
+        return -1;
+    }
+
+    _redis_cluster_bulk_cmd *c = (_redis_cluster_bulk_cmd *)calloc(1, sizeof(_redis_cluster_bulk_cmd));
+    if (!c) {
+        return -1;
+    }
+    c->cmd = (char *)malloc(len);
+    if (!c->cmd) {
+        free(c);
+        return -1;
+    }
+    memcpy(c->cmd, cmd, len);
+    c->len = len;
+    c->slot = slot;
+    c->ask_node = -1;
+    c->seq = ++bulk->seq;
+    ++bulk->stats.commands;
+    _redis_cluster_traffic_slot(bulk->cluster, slot);
+
+    /* Accepted from here on, failures to send are retried by the next add or
+     * by finish, and commands that run out of attempts show in its result */
+    if (_redis_cluster_bulk_service(bulk) < 0 || bulk->held[slot] > 0) {
+        /* Held behind earlier commands of the slot or a failed service, due at once */
+        c->held = 1;
+        ++bulk->held[slot];
+        clock_gettime(CLOCK_MONOTONIC, &c->not_before);
+        _redis_cluster_bulk_insert(&bulk->retry, c);
+        return 0;
+    }
+    _redis_cluster_bulk_send(bulk, c);
+    return 0;
+}
+
+int redis_cluster_bulk_add_argv(redis_cluster_bulk_st *bulk, int argc, const char **argv, const size_t *argvlen)
+{
+    if (!bulk || argc <= 0 || !argv) {
+        return -1;
+    }
+
+    char *cmd = NULL;
+    long long len;
+    size_t keylen;
+    int slot;
+    int rc;
+
+    len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+    if (len < 0) {
+        return -1;
+    }
+
+    /* The first argument is the key for the commands a bulk load carries */
+    if (argc > 1) {
+        keylen = argvlen ? argvlen[1] : strlen(argv[1]);
+        slot = redis_cluster_keyslot(argv[1], keylen);
+        _redis_cluster_traffic_key(bulk->cluster, slot, argv[1], keylen);
+    } else {
+        slot = 0;
+    }
+    rc = redis_cluster_bulk_add(bulk, slot, cmd, (size_t)len);
+    redisFreeCommand(cmd);
+    return rc;
+}
+
+int redis_cluster_bulk_finish(redis_cluster_bulk_st *bulk)
+{
+    if (!bulk) {
+        return -1;
+    }
+
+    struct timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = 1000000;
+
+    for (;;) {
+        if (_redis_cluster_bulk_service(bulk) < 0) {
+            return -1;
+        }
+        if (0 == bulk->inflight && 0 == bulk->retry.count) {
+            break;
+        }
+
+        if (bulk->inflight > 0) {
+            if (_redis_cluster_bulk_pump(bulk) < 0) {
+                return -1;
+            }
+        } else {
+            /* Only backed off retries left */
+            nanosleep(&delay, NULL);
+        }
+    }
+
+    return bulk->stats.errors > 0 ? -1 : 0;
+}
+
+void redis_cluster_bulk_get_stats(redis_cluster_bulk_st *bulk, redis_cluster_bulk_stats_st *stats)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    *stats = bulk->stats;
+    stats->elapsed = (now.tv_sec - bulk->start.tv_sec) + (now.tv_nsec - bulk->start.tv_nsec) / 1e9;
+}
@@ -0,0 +1,370 @@
+/* ppoll */
+#define _GNU_SOURCE
+
+#include "redis_cluster.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <poll.h>
+
+/* Hedged reads
+ *
+ * The read goes to the slot master as usual. If nothing came back within
+ * the hedging delay, it is also sent to a connected replica of that master
+ * after READONLY, and whichever starts answering first wins. The reply of
+ * the loser is left on its connection as an orphan and dropped by the next
+ * reader, so no connection is torn down. */
+
+#define _HEDGE_SAMPLES 1024
+/* Recompute the delay every so many reads */
+#define _HEDGE_UPDATE 64
+/* Halve the load counters past this many reads, recent traffic counts most */
+#define _HEDGE_WINDOW 8192
+
+struct _redis_cluster_hedge_st {
+    redis_cluster_hedge_policy_st policy;
+    uint32_t samples[_HEDGE_SAMPLES];   /* Read latencies in microseconds */
+    int sample_count;
+    int sample_next;
+    int since_update;
+    int delay_us;
+    uint64_t window_reads;
+    uint64_t window_hedged;
+    redis_cluster_hedge_stats_st stats;
+};
+
+static long _redis_cluster_hedge_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static int _redis_cluster_hedge_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void _redis_cluster_hedge_sample(_redis_cluster_hedge_st *hedge, long us)
+{
+    uint32_t sorted[_HEDGE_SAMPLES];
+    long delay;
+
+    hedge->samples[hedge->sample_next] = us > 0 ? (uint32_t)us : 0;
+    hedge->sample_next = (hedge->sample_next + 1) % _HEDGE_SAMPLES;
+    if (hedge->sample_count < _HEDGE_SAMPLES) {
+        ++hedge->sample_count;
+    }
+    if (++hedge->since_update < _HEDGE_UPDATE) {
+        return;
+    }
+    hedge->since_update = 0;
+
+    memcpy(sorted, hedge->samples, hedge->sample_count * sizeof(uint32_t));
+    qsort(sorted, hedge->sample_count, sizeof(uint32_t), _redis_cluster_hedge_cmp);
+    delay = sorted[(hedge->sample_count - 1) * hedge->policy.percentile / 100];
+    hedge->delay_us = delay > hedge->policy.min_delay_us ? (int)delay : hedge->policy.min_delay_us;
+}
+
+/* Hedging stays within max_extra_pct of the recent reads */
+static int _redis_cluster_hedge_allowed(_redis_cluster_hedge_st *hedge)
+{
+    return hedge->window_hedged * 100 < hedge->window_reads * hedge->policy.max_extra_pct;
+}
+
+/* Replica of master able to take the read right away, picked at random */
+static redis_cluster_node_st *_redis_cluster_hedge_replica(redis_cluster_st *cluster, redis_cluster_node_st *master)
+{
+    redis_cluster_node_st *replica = NULL;
+    redis_cluster_node_st *node;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < cluster->node_count; ++i) {
+        node = cluster->redis_nodes[i];
+        if (node->master_id != master->id || !node->ctx || node->ctx->err || node->pending != node->orphans) {
+            continue;
+        }
+        if (0 == rand_r(&cluster->retry_seed) % ++count) {
+            replica = node;
+        }
+    }
+    return replica;
+}
+
+static void _redis_cluster_hedge_close(redis_cluster_node_st *node)
+{
+    if (node->ctx) {
+        redisFree(node->ctx);
+        node->ctx = NULL;
+    }
+    node->pending = 0;
+    node->orphans = 0;
+}
+
+static int _redis_cluster_hedge_flush(redisContext *ctx)
+{
+    int done = 0;
+    while (!done) {
+        if (REDIS_OK != redisBufferWrite(ctx, &done)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Drop the orphans already buffered, without blocking. 1 once none is left before ours. */
+static int _redis_cluster_hedge_skip_orphans(redis_cluster_node_st *node)
+{
+    redisReply *reply;
+
+    while (node->orphans > 0) {
+        reply = NULL;
+        if (REDIS_OK != redisGetReplyFromReader(node->ctx, (void **)&reply)) {
+            return -1;
+        }
+        if (!reply) {
+            return 0;
+        }
+        freeReplyObject(reply);
+        --node->orphans;
+        --node->pending;
+    }
+    return 1;
+}
+
+/* Whether the master started answering, waiting at most timeout_us */
+static int _redis_cluster_hedge_wait_master(redis_cluster_node_st *master, long timeout_us)
+{
+    struct timespec start;
+    struct timespec wait;
+    struct pollfd pfd;
+    long left;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        rc = _redis_cluster_hedge_skip_orphans(master);
+        if (rc < 0) {
+            return 1;
+        }
+        if (rc > 0 && master->ctx->reader->pos < master->ctx->reader->len) {
+            return 1;
+        }
+
+        left = timeout_us - _redis_cluster_hedge_us(&start);
+        if (left <= 0) {
+            return 0;
+        }
+        pfd.fd = master->ctx->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        /* The delay is sub-millisecond, poll would round it up */
+        wait.tv_sec = left / 1000000;
+        wait.tv_nsec = (left % 1000000) * 1000;
+        rc = ppoll(&pfd, 1, &wait, NULL);
+        if (rc < 0 && EINTR != errno) {
+            return 1;
+        }
+        /* Errors surface in get_reply */
+        if (rc > 0 && REDIS_OK != redisBufferRead(master->ctx)) {
+            return 1;
+        }
+    }
+}
+
+/* Race the replica against the master. Returns the replica reply when it
+ * won, NULL when the master reply is to be read the usual way. */
+static redisReply *_redis_cluster_hedge_race(redis_cluster_st *cluster, redis_cluster_node_st *master,
+        redis_cluster_node_st *replica)
+{
+    struct timespec start;
+    struct pollfd pfd[2];
+    redisReply *reply;
+    long timeout_ms = cluster->timeout.tv_sec * 1000 + cluster->timeout.tv_usec / 1000;
+    long left;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        rc = _redis_cluster_hedge_skip_orphans(replica);
+        reply = NULL;
+        if (rc < 0 || (rc > 0 && REDIS_OK != redisGetReplyFromReader(replica->ctx, (void **)&reply))) {
+            _redis_cluster_hedge_close(replica);
+            return NULL;
+        }
+        if (reply) {
+            --replica->pending;
+            /* Errors, MOVED included, are left to the master */
+            if (REDIS_REPLY_ERROR == reply->type) {
+                freeReplyObject(reply);
+                return NULL;
+            }
+            return reply;
+        }
+
+        rc = _redis_cluster_hedge_skip_orphans(master);
+        if (rc < 0 || (rc > 0 && master->ctx->reader->pos < master->ctx->reader->len)) {
+            break;
+        }
+
+        left = timeout_ms - _redis_cluster_hedge_us(&start) / 1000;
+        if (left <= 0) {
+            break;
+        }
+        pfd[0].fd = master->ctx->fd;
+        pfd[1].fd = replica->ctx->fd;
+        pfd[0].events = pfd[1].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = 0;
+        rc = poll(pfd, 2, (int)left);
+        if (rc < 0 && EINTR != errno) {
+            break;
+        }
+        if (rc > 0 && pfd[1].revents && REDIS_OK != redisBufferRead(replica->ctx)) {
+            _redis_cluster_hedge_close(replica);
+            return NULL;
+        }
+        if (rc > 0 && pfd[0].revents && REDIS_OK != redisBufferRead(master->ctx)) {
+            break;
+        }
+    }
+
+    /* Master first, the replica reply is not waited for */
+    ++replica->orphans;
+    return NULL;
+}
+
+redisReply *redis_cluster_v_execute_read(redis_cluster_st *cluster, const char *key, const char *fmt, va_list ap)
+{
+    if (!cluster || !key || !fmt) {
+        return NULL;
+    }
+
+    _redis_cluster_hedge_st *hedge = cluster->hedge;
+    redis_cluster_node_st *master;
+    redis_cluster_node_st *replica;
+    redisReply *reply = NULL;
+    _append_slot_record *record;
+    struct timespec start;
+    struct timespec span_ts = {0, 0};
+    size_t len;
+    int slot;
+    int rc;
+
+    if (!hedge) {
+        return redis_cluster_v_execute(cluster, key, fmt, ap);
+    }
+
+    len = strlen(key);
+    slot = redis_cluster_keyslot(key, len);
+    _redis_cluster_traffic_key(cluster, slot, key, len);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    _redis_cluster_noreply_skip(cluster);
+    _slot_list_reset(cluster->slot_list);
+    rc = redis_cluster_arg_append(cluster, slot, fmt, ap);
+    if (rc < 0) {
+        return NULL;
+    }
+    record = &cluster->slot_list->list[cluster->slot_list->count - 1];
+
+    ++hedge->stats.reads;
+    if (++hedge->window_reads > _HEDGE_WINDOW) {
+        hedge->window_reads /= 2;
+        hedge->window_hedged /= 2;
+    }
+
+    /* Only a master with nothing but this read in flight can be raced */
+    master = cluster->slots_handler[slot];
+    if (master->pending == master->orphans + 1 && _redis_cluster_hedge_allowed(hedge)
+            && 0 == _redis_cluster_hedge_flush(master->ctx)
+            && !_redis_cluster_hedge_wait_master(master, hedge->delay_us)
+            && (replica = _redis_cluster_hedge_replica(cluster, master))) {
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_HEDGE, slot);
+        rc = REDIS_OK;
+        if (!replica->readonly) {
+            rc = redisAppendCommand(replica->ctx, "READONLY");
+            ++replica->orphans;
+            ++replica->pending;
+            replica->readonly = 1;
+        }
+        if (REDIS_OK == rc) {
+            rc = redisAppendFormattedCommand(replica->ctx, record->cmd, record->cmd_len);
+        }
+        if (REDIS_OK != rc || _redis_cluster_hedge_flush(replica->ctx) < 0) {
+            _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_HEDGE, slot, replica, -1);
+            _redis_cluster_hedge_close(replica);
+        } else {
+            ++replica->pending;
+            ++hedge->stats.hedged;
+            ++hedge->window_hedged;
+            reply = _redis_cluster_hedge_race(cluster, master, replica);
+            if (reply) {
+                /* The master reply is now the orphan, its record is done */
+                ++hedge->stats.replica_wins;
+                ++master->orphans;
+                _slot_list_get(cluster->slot_list);
+            }
+            _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_HEDGE, slot, replica, reply ? 0 : -1);
+        }
+    }
+
+    if (!reply) {
+        reply = redis_cluster_get_reply(cluster);
+    }
+    _redis_cluster_hedge_sample(hedge, _redis_cluster_hedge_us(&start));
+    hedge->stats.delay_us = hedge->delay_us;
+    return reply;
+}
+
+redisReply *redis_cluster_execute_read(redis_cluster_st *cluster, const char *key, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    redisReply *r = redis_cluster_v_execute_read(cluster, key, fmt, ap);
+    va_end(ap);
+
+    return r;
+}
+
+int redis_cluster_set_hedging(redis_cluster_st *cluster, const redis_cluster_hedge_policy_st *policy)
+{
+    if (!cluster || (policy && (policy->percentile < 0 || policy->percentile > 100 || policy->min_delay_us < 0
+            || policy->max_extra_pct < 0 || policy->max_extra_pct > 100))) {
+        return -1;
+    }
+
+    _redis_cluster_hedge_free(cluster);
+    if (!policy || 0 == policy->percentile) {
+        return 0;
+    }
+
+    cluster->hedge = (_redis_cluster_hedge_st *)calloc(1, sizeof(_redis_cluster_hedge_st));
+    if (!cluster->hedge) {
+        return -1;
+    }
+    cluster->hedge->policy = *policy;
+    cluster->hedge->delay_us = policy->min_delay_us;
+    return 0;
+}
+
+int redis_cluster_get_hedge_stats(redis_cluster_st *cluster, redis_cluster_hedge_stats_st *stats)
+{
+    if (!cluster || !cluster->hedge || !stats) {
+        return -1;
+    }
+
+    *stats = cluster->hedge->stats;
+    return 0;
+}
+
+void _redis_cluster_hedge_free(redis_cluster_st *cluster)
+{
+    free(cluster->hedge);
+    cluster->hedge = NULL;
+}
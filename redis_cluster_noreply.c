@@ -0,0 +1,220 @@
+#include "redis_cluster.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Fire-and-forget commands
+ *
+ * The reply still has to be read to keep the connection in step, but the
+ * reader is switched to object functions that build nothing: every value
+ * becomes the same static reply. Only a top-level error gets a real object,
+ * so MOVED, ASK and retryable errors go through the usual redirection code.
+ * CLIENT REPLY OFF is not used, a MOVED would go unnoticed with it. */
+
+#define _NOREPLY_HWM 1024
+
+static redisReply _redis_cluster_noreply_ok = { .type = REDIS_REPLY_STATUS };
+
+static void *_redis_cluster_noreply_string(const redisReadTask *task, char *str, size_t len)
+{
+    redisReply *reply;
+
+    if (REDIS_REPLY_ERROR != task->type || task->parent) {
+        return &_redis_cluster_noreply_ok;
+    }
+
+    reply = (redisReply *)calloc(1, sizeof(redisReply));
+    if (!reply) {
+        return NULL;
+    }
+    reply->str = (char *)malloc(len + 1);
+    if (!reply->str) {
+        free(reply);
+        return NULL;
+    }
+    memcpy(reply->str, str, len);
+    reply->str[len] = '\0';
+    reply->len = len;
+    reply->type = REDIS_REPLY_ERROR;
+    return reply;
+}
+
+static void *_redis_cluster_noreply_array(const redisReadTask *task, size_t elements)
+{
+    return &_redis_cluster_noreply_ok;
+}
+
+static void *_redis_cluster_noreply_integer(const redisReadTask *task, long long value)
+{
+    return &_redis_cluster_noreply_ok;
+}
+
+static void *_redis_cluster_noreply_double(const redisReadTask *task, double value, char *str, size_t len)
+{
+    return &_redis_cluster_noreply_ok;
+}
+
+static void *_redis_cluster_noreply_nil(const redisReadTask *task)
+{
+    return &_redis_cluster_noreply_ok;
+}
+
+static void *_redis_cluster_noreply_bool(const redisReadTask *task, int value)
+{
+    return &_redis_cluster_noreply_ok;
+}
+
+void _redis_cluster_noreply_free(void *reply)
+{
+    if (reply != &_redis_cluster_noreply_ok) {
+        freeReplyObject(reply);
+    }
+}
+
+static redisReplyObjectFunctions _redis_cluster_noreply_fn = {
+    _redis_cluster_noreply_string,
+    _redis_cluster_noreply_array,
+    _redis_cluster_noreply_integer,
+    _redis_cluster_noreply_double,
+    _redis_cluster_noreply_nil,
+    _redis_cluster_noreply_bool,
+    _redis_cluster_noreply_free
+};
+
+/* One whole reply is read, the reader is never left half way with our functions */
+int _redis_cluster_noreply_get_reply(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node, void **reply)
+{
+    redisReader *reader = cluster_node->ctx->reader;
+    redisReplyObjectFunctions *fn = reader->fn;
+    int rc;
+
+    reader->fn = &_redis_cluster_noreply_fn;
+    if (REDIS_CLUSTER_IO_URING == cluster->io_engine) {
+        rc = _redis_cluster_uring_get_reply(cluster, cluster_node, reply);
+    } else {
+        rc = redisGetReply(cluster_node->ctx, reply);
+    }
+    /* A reply cut short must not reach freeReplyObject */
+    if (reader->reply == &_redis_cluster_noreply_ok) {
+        reader->reply = NULL;
+    }
+    reader->fn = fn;
+    return rc;
+}
+
+int _redis_cluster_noreply_skip(redis_cluster_st *cluster)
+{
+    _append_slot_list *slot_list = cluster->slot_list;
+    redisReply *reply;
+    int ret = 0;
+
+    while (slot_list->pos < slot_list->count && slot_list->list[slot_list->pos].noreply) {
+        reply = _redis_cluster_record_reply(cluster, _slot_list_get(slot_list));
+        if (!reply) {
+            ++cluster->noreply_stats.lost;
+            ret = -1;
+            continue;
+        }
+        if (reply == &_redis_cluster_noreply_ok) {
+            continue;
+        }
+        /* Replays are read the usual way */
+        if (REDIS_REPLY_ERROR == reply->type) {
+            ++cluster->noreply_stats.errors;
+        }
+        freeReplyObject(reply);
+    }
+
+    return ret;
+}
+
+int redis_cluster_noreply_drain(redis_cluster_st *cluster)
+{
+    if (!cluster || !cluster->slot_list) {
+        return -1;
+    }
+
+    /* Every node answers while the first one is read */
+    int rc = redis_cluster_flush(cluster);
+    if (_redis_cluster_noreply_skip(cluster) < 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+/* The record takes cmd over */
+static int _redis_cluster_noreply_append(redis_cluster_st *cluster, int slot, char *cmd, size_t len)
+{
+    _append_slot_list *slot_list = cluster->slot_list;
+    int rc = _redis_cluster_formatted_append(cluster, slot, cmd, len, _REDIS_CLUSTER_CMD_OWNED | _REDIS_CLUSTER_CMD_NOREPLY);
+
+    /* Nobody calls get_reply for these, keep the backlog bounded. Behind a
+     * normal record nothing can be skipped until get_reply reads it. */
+    if (rc < 0) {
+        return -1;
+    }
+    /* Queued, a failed drain is counted in the lost stats */
+    if (slot_list->count - slot_list->pos >= _NOREPLY_HWM && slot_list->list[slot_list->pos].noreply) {
+        redis_cluster_noreply_drain(cluster);
+    }
+    return 0;
+}
+
+int redis_cluster_formatted_append_noreply(redis_cluster_st *cluster, int slot, const char *cmd, size_t len)
+{
+    if (!cluster || slot < 0 || slot >= REDIS_CLUSTER_SLOTS || !cmd) {
+        return -1;
+    }
+
+    /* Kept for replays, the caller's buffer may be gone by then */
+    char *copy = (char *)malloc(len);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, cmd, len);
+
+    return _redis_cluster_noreply_append(cluster, slot, copy, len);
+}
+
+int redis_cluster_v_append_noreply(redis_cluster_st *cluster, const char *key, const char *fmt, va_list ap)
+{
+    if (!cluster || !key || !fmt) {
+        return -1;
+    }
+
+    size_t len = strlen(key);
+    int slot = redis_cluster_keyslot(key, len);
+    char *cmd = NULL;
+    int cmd_len;
+
+    _redis_cluster_traffic_key(cluster, slot, key, len);
+    /* Formatted straight into the record's buffer, hiredis allocates with malloc */
+    cmd_len = redisvFormatCommand(&cmd, fmt, ap);
+    if (cmd_len < 0) {
+        return -1;
+    }
+    return _redis_cluster_noreply_append(cluster, slot, cmd, cmd_len);
+}
+
+int redis_cluster_append_noreply(redis_cluster_st *cluster, const char *key, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int rc = redis_cluster_v_append_noreply(cluster, key, fmt, ap);
+    va_end(ap);
+
+    return rc;
+}
+
+int redis_cluster_get_noreply_stats(redis_cluster_st *cluster, redis_cluster_noreply_stats_st *stats, int reset)
+{
+    if (!cluster || !stats) {
+        return -1;
+    }
+
+    *stats = cluster->noreply_stats;
+    if (reset) {
+        memset(&cluster->noreply_stats, 0x00, sizeof(cluster->noreply_stats));
+    }
+    return 0;
+}
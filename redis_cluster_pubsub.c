@@ -0,0 +1,475 @@
+#include "redis_cluster.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <poll.h>
+
+/* Sharded Pub/Sub
+ *
+ * Every channel is subscribed on the master of its slot, through a
+ * subscriber connection of its own: a connection in subscribed state can
+ * not run other commands. Subscriber connections are keyed by ip:port, so
+ * they survive topology refreshes that rebuild redis_nodes. */
+
+/* Refreshes asked by subscription errors, at most one per period */
+#define _PUBSUB_REFRESH_MS 1000
+
+typedef struct {
+    char *name;
+    size_t len;
+    int slot;
+    int sub;        /* Index in subs, -1 while not subscribed anywhere */
+} _redis_cluster_channel;
+
+struct _redis_cluster_pubsub_st {
+    redis_cluster_message_cb cb;
+    void *privdata;
+
+    _redis_cluster_channel *channels;
+    int channel_count;
+    int channel_cap;
+
+    redis_cluster_node_st *subs[REDIS_CLUSTER_NODE_COUNT];
+    int sub_count;
+
+    uint64_t epoch;     /* topology_epoch the subscriptions were placed for */
+    int need_sync;
+    int need_refresh;
+    struct timespec refreshed;  /* Last refresh done for pubsub */
+    int dispatching;    /* Inside the callback, connections must not go away */
+};
+
+static int _redis_cluster_channel_find(_redis_cluster_pubsub_st *pubsub, const char *name, size_t len)
+{
+    int i;
+    for (i = 0; i < pubsub->channel_count; ++i) {
+        if (pubsub->channels[i].len == len && 0 == memcmp(pubsub->channels[i].name, name, len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int _redis_cluster_sub_find(_redis_cluster_pubsub_st *pubsub, const char *ip, int port)
+{
+    int i;
+    for (i = 0; i < pubsub->sub_count; ++i) {
+        if (pubsub->subs[i]->port == port && 0 == strcmp(pubsub->subs[i]->ip, ip)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Drop a subscriber connection, its channels are placed again on next sync */
+static void _redis_cluster_sub_drop(_redis_cluster_pubsub_st *pubsub, int sub)
+{
+    int last = pubsub->sub_count - 1;
+    int i;
+
+    _redis_cluster_node_free(pubsub->subs[sub]);
+    pubsub->subs[sub] = pubsub->subs[last];
+    pubsub->subs[last] = NULL;
+    --pubsub->sub_count;
+
+    for (i = 0; i < pubsub->channel_count; ++i) {
+        if (pubsub->channels[i].sub == sub) {
+            pubsub->channels[i].sub = -1;
+            pubsub->need_sync = 1;
+        } else if (pubsub->channels[i].sub == last) {
+            pubsub->channels[i].sub = sub;
+        }
+    }
+}
+
+static int _redis_cluster_sub_get(redis_cluster_st *cluster, redis_cluster_node_st *owner)
+{
+    _redis_cluster_pubsub_st *pubsub = cluster->pubsub;
+    redis_cluster_node_st *node;
+    int sub = _redis_cluster_sub_find(pubsub, owner->ip, owner->port);
+
+    if (sub >= 0) {
+        return sub;
+    }
+    if (pubsub->sub_count >= REDIS_CLUSTER_NODE_COUNT) {
+        return -1;
+    }
+
+    node = _redis_cluster_node_init(pubsub->sub_count, owner->ip, owner->port);
+    if (!node) {
+        return -1;
+    }
+    if (_redis_cluster_node_connect(cluster, node) < 0) {
+        _redis_cluster_node_free(node);
+        return -1;
+    }
+    pubsub->subs[pubsub->sub_count] = node;
+    return pubsub->sub_count++;
+}
+
+static int _redis_cluster_sub_flush(redis_cluster_st *cluster, int sub)
+{
+    redis_cluster_node_st *node = cluster->pubsub->subs[sub];
+    struct timespec span_ts = {0, 0};
+    int done = 0;
+    int rc = 0;
+
+    cluster->trace_current = 0;
+    _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, -1);
+    while (!done) {
+        if (REDIS_OK != redisBufferWrite(node->ctx, &done)) {
+            rc = -1;
+            break;
+        }
+    }
+    _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WRITE, -1, node, rc);
+    return rc;
+}
+
+/* Place every channel on the connection to the current master of its slot */
+static int _redis_cluster_pubsub_sync(redis_cluster_st *cluster)
+{
+    _redis_cluster_pubsub_st *pubsub = cluster->pubsub;
+    _redis_cluster_channel *channel;
+    redis_cluster_node_st *owner;
+    struct timespec now;
+    int used[REDIS_CLUSTER_NODE_COUNT];
+    int rc = 0;
+    int sub;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (pubsub->need_refresh && ((now.tv_sec - pubsub->refreshed.tv_sec) * 1000
+                + (now.tv_nsec - pubsub->refreshed.tv_nsec) / 1000000 >= _PUBSUB_REFRESH_MS)) {
+        pubsub->refreshed = now;
+        if (_redis_cluster_refresh(cluster) < 0) {
+            pubsub->need_sync = 1;
+            return -1;
+        }
+        pubsub->need_refresh = 0;
+    }
+    pubsub->epoch = cluster->topology_epoch;
+    /* Refresh put off, the map at hand is used meanwhile */
+    pubsub->need_sync = pubsub->need_refresh;
+
+    for (i = 0; i < pubsub->channel_count; ++i) {
+        channel = &pubsub->channels[i];
+        owner = cluster->slots_handler[channel->slot];
+        if (!owner) {
+            pubsub->need_refresh = 1;
+            rc = -1;
+            continue;
+        }
+
+        sub = _redis_cluster_sub_get(cluster, owner);
+        if (sub < 0) {
+            pubsub->need_refresh = 1;
+            rc = -1;
+            continue;
+        }
+        if (channel->sub == sub) {
+            continue;
+        }
+
+        /* Slot moved, the old node would keep delivering nothing */
+        if (channel->sub >= 0) {
+            redisAppendCommand(pubsub->subs[channel->sub]->ctx, "SUNSUBSCRIBE %b", channel->name, channel->len);
+        }
+        if (REDIS_OK != redisAppendCommand(pubsub->subs[sub]->ctx, "SSUBSCRIBE %b", channel->name, channel->len)) {
+            rc = -1;
+            continue;
+        }
+        channel->sub = sub;
+    }
+    if (rc < 0) {
+        pubsub->need_sync = 1;
+    }
+
+    /* Send everything, close connections left without channels */
+    memset(used, 0x00, sizeof(used));
+    for (i = 0; i < pubsub->channel_count; ++i) {
+        if (pubsub->channels[i].sub >= 0) {
+            used[pubsub->channels[i].sub] = 1;
+        }
+    }
+    for (sub = pubsub->sub_count - 1; sub >= 0; --sub) {
+        if (!used[sub] || _redis_cluster_sub_flush(cluster, sub) < 0) {
+            used[sub] = used[pubsub->sub_count - 1];
+            _redis_cluster_sub_drop(pubsub, sub);
+        }
+    }
+
+    return rc;
+}
+
+static int _redis_cluster_pubsub_dispatch(redis_cluster_st *cluster, int sub, redisReply *reply)
+{
+    _redis_cluster_pubsub_st *pubsub = cluster->pubsub;
+    redisReply *kind;
+    char ip[64];
+    int port;
+    int slot = -1;
+    int node_idx = -1;
+    int idx;
+
+    if (REDIS_REPLY_ERROR == reply->type) {
+        /* MOVED for a slot that changed hands before the subscription arrived,
+         * its channels follow the target without a refresh */
+        if (REDIS_CLUSTER_ERR_MOVED == _redis_cluster_error_class(reply)
+                && 0 == _redis_cluster_redirect_target(reply->str, &slot, ip, sizeof(ip), &port)) {
+            node_idx = _redis_cluster_find_connection(cluster, ip, port);
+        }
+        if (node_idx >= 0) {
+            _redis_cluster_set_slot(cluster, cluster->redis_nodes[node_idx], slot);
+        } else {
+            slot = -1;
+            pubsub->need_refresh = 1;
+        }
+        pubsub->need_sync = 1;
+        for (idx = 0; idx < pubsub->channel_count; ++idx) {
+            if (pubsub->channels[idx].sub == sub && (slot < 0 || pubsub->channels[idx].slot == slot)) {
+                pubsub->channels[idx].sub = -1;
+            }
+        }
+        return 0;
+    }
+    if (REDIS_REPLY_ARRAY != reply->type || reply->elements < 3 || REDIS_REPLY_STRING != reply->element[0]->type) {
+        return 0;
+    }
+
+    kind = reply->element[0];
+    if (8 == kind->len && 0 == memcmp(kind->str, "smessage", 8)) {
+        pubsub->dispatching = 1;
+        pubsub->cb(cluster, reply->element[1]->str, reply->element[1]->len,
+                reply->element[2]->str, reply->element[2]->len, pubsub->privdata);
+        pubsub->dispatching = 0;
+        return 1;
+    }
+
+    /* Unsolicited when the slot was migrated away, subscribe again where it went */
+    if (12 == kind->len && 0 == memcmp(kind->str, "sunsubscribe", 12) && REDIS_REPLY_STRING == reply->element[1]->type) {
+        idx = _redis_cluster_channel_find(pubsub, reply->element[1]->str, reply->element[1]->len);
+        if (idx >= 0 && pubsub->channels[idx].sub == sub) {
+            pubsub->channels[idx].sub = -1;
+            pubsub->need_refresh = 1;
+            pubsub->need_sync = 1;
+        }
+    }
+    return 0;
+}
+
+/* Dispatch the replies already parsed or buffered on a subscriber connection */
+static int _redis_cluster_pubsub_drain(redis_cluster_st *cluster, int sub)
+{
+    redisReply *reply;
+    int count = 0;
+
+    for (;;) {
+        reply = NULL;
+        if (REDIS_OK != redisGetReplyFromReader(cluster->pubsub->subs[sub]->ctx, (void **)&reply)) {
+            return -1;
+        }
+        if (!reply) {
+            return count;
+        }
+        count += _redis_cluster_pubsub_dispatch(cluster, sub, reply);
+        freeReplyObject(reply);
+    }
+}
+
+int redis_cluster_set_message_cb(redis_cluster_st *cluster, redis_cluster_message_cb cb, void *privdata)
+{
+    if (!cluster || !cb) {
+        return -1;
+    }
+
+    if (!cluster->pubsub) {
+        cluster->pubsub = (_redis_cluster_pubsub_st *)calloc(1, sizeof(_redis_cluster_pubsub_st));
+        if (!cluster->pubsub) {
+            return -1;
+        }
+        cluster->pubsub->epoch = cluster->topology_epoch;
+    }
+    cluster->pubsub->cb = cb;
+    cluster->pubsub->privdata = privdata;
+    return 0;
+}
+
+int redis_cluster_ssubscribe(redis_cluster_st *cluster, const char *channel)
+{
+    if (!cluster || !cluster->pubsub || !channel) {
+        return -1;
+    }
+
+    _redis_cluster_pubsub_st *pubsub = cluster->pubsub;
+    _redis_cluster_channel *channels;
+    _redis_cluster_channel *entry;
+    size_t len = strlen(channel);
+
+    if (_redis_cluster_channel_find(pubsub, channel, len) >= 0) {
+        return 0;
+    }
+
+    if (pubsub->channel_count == pubsub->channel_cap) {
+        int cap = pubsub->channel_cap ? pubsub->channel_cap * 2 : 16;
+        channels = (_redis_cluster_channel *)realloc(pubsub->channels, cap * sizeof(_redis_cluster_channel));
+        if (!channels) {
+            return -1;
+        }
+        pubsub->channels = channels;
+        pubsub->channel_cap = cap;
+    }
+
+    entry = &pubsub->channels[pubsub->channel_count];
+    entry->name = (char *)malloc(len + 1);
+    if (!entry->name) {
+        return -1;
+    }
+    memcpy(entry->name, channel, len + 1);
+    entry->len = len;
+    entry->slot = redis_cluster_keyslot(channel, len);
+    entry->sub = -1;
+    ++pubsub->channel_count;
+
+    if (pubsub->dispatching) {
+        pubsub->need_sync = 1;
+        return 0;
+    }
+    return _redis_cluster_pubsub_sync(cluster);
+}
+
+int redis_cluster_sunsubscribe(redis_cluster_st *cluster, const char *channel)
+{
+    if (!cluster || !cluster->pubsub || !channel) {
+        return -1;
+    }
+
+    _redis_cluster_pubsub_st *pubsub = cluster->pubsub;
+    size_t len = strlen(channel);
+    int idx = _redis_cluster_channel_find(pubsub, channel, len);
+    int sub;
+
+    if (idx < 0) {
+        return 0;
+    }
+
+    sub = pubsub->channels[idx].sub;
+    free(pubsub->channels[idx].name);
+    pubsub->channels[idx] = pubsub->channels[--pubsub->channel_count];
+
+    /* A broken connection is noticed by the next poll */
+    if (sub >= 0) {
+        if (REDIS_OK != redisAppendCommand(pubsub->subs[sub]->ctx, "SUNSUBSCRIBE %b", channel, len)
+                || _redis_cluster_sub_flush(cluster, sub) < 0) {
+            pubsub->need_sync = 1;
+        }
+    }
+    return 0;
+}
+
+int redis_cluster_spublish(redis_cluster_st *cluster, const char *channel, const char *message, size_t len)
+{
+    if (!cluster || !channel || !message) {
+        return -1;
+    }
+
+    int receivers = -1;
+    redisReply *reply = redis_cluster_execute(cluster, channel, "SPUBLISH %s %b", channel, message, len);
+    if (!reply) {
+        return -1;
+    }
+    /* Error replies, e.g. CLUSTERDOWN, count as failure */
+    if (REDIS_REPLY_INTEGER == reply->type) {
+        receivers = (int)reply->integer;
+    }
+    freeReplyObject(reply);
+    return receivers;
+}
+
+int redis_cluster_pubsub_poll(redis_cluster_st *cluster, int timeout_ms)
+{
+    if (!cluster || !cluster->pubsub) {
+        return -1;
+    }
+
+    _redis_cluster_pubsub_st *pubsub = cluster->pubsub;
+    struct pollfd fds[REDIS_CLUSTER_NODE_COUNT];
+    struct timespec span_ts = {0, 0};
+    int count = 0;
+    int rc;
+    int sub;
+
+    /* Topology changed under us, or a subscription was lost */
+    if (pubsub->need_sync || pubsub->epoch != cluster->topology_epoch) {
+        _redis_cluster_pubsub_sync(cluster);
+    }
+
+    /* Replies parsed by an earlier read are delivered without waiting */
+    for (sub = pubsub->sub_count - 1; sub >= 0; --sub) {
+        rc = _redis_cluster_pubsub_drain(cluster, sub);
+        if (rc < 0) {
+            pubsub->need_refresh = 1;
+            _redis_cluster_sub_drop(pubsub, sub);
+        } else if (rc > 0) {
+            count += rc;
+            timeout_ms = 0;
+        }
+    }
+
+    if (0 == pubsub->sub_count && timeout_ms < 0) {
+        return count;
+    }
+    for (sub = 0; sub < pubsub->sub_count; ++sub) {
+        fds[sub].fd = pubsub->subs[sub]->ctx->fd;
+        fds[sub].events = POLLIN;
+        fds[sub].revents = 0;
+    }
+    rc = poll(fds, pubsub->sub_count, timeout_ms);
+    if (rc < 0) {
+        return EINTR == errno ? count : -1;
+    }
+
+    for (sub = pubsub->sub_count - 1; sub >= 0; --sub) {
+        if (!fds[sub].revents) {
+            continue;
+        }
+        /* Reading only, the time spent in the callback is the caller's */
+        cluster->trace_current = 0;
+        _REDIS_CLUSTER_SPAN_BEGIN(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, -1);
+        rc = redisBufferRead(pubsub->subs[sub]->ctx);
+        _REDIS_CLUSTER_SPAN_END(cluster, span_ts, REDIS_CLUSTER_SPAN_WAIT, -1, pubsub->subs[sub], REDIS_OK == rc ? 0 : -1);
+        if (REDIS_OK != rc || (rc = _redis_cluster_pubsub_drain(cluster, sub)) < 0) {
+            /* Node gone, most likely failed over */
+            pubsub->need_refresh = 1;
+            _redis_cluster_sub_drop(pubsub, sub);
+            continue;
+        }
+        count += rc;
+    }
+
+    return count;
+}
+
+void _redis_cluster_pubsub_free(redis_cluster_st *cluster)
+{
+    _redis_cluster_pubsub_st *pubsub = cluster->pubsub;
+    int i;
+
+    if (!pubsub) {
+        return;
+    }
+
+    for (i = 0; i < pubsub->sub_count; ++i) {
+        _redis_cluster_node_free(pubsub->subs[i]);
+    }
+    for (i = 0; i < pubsub->channel_count; ++i) {
+        free(pubsub->channels[i].name);
+    }
+    free(pubsub->channels);
+    free(pubsub);
+    cluster->pubsub = NULL;
+}
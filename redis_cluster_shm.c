@@ -0,0 +1,348 @@
+#include "redis_cluster.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include <sys/mman.h>
+
+/* Shared topology
+ *
+ * The segment holds the slot map behind a sequence counter, odd while a
+ * writer is inside: readers copy the map and keep the copy only if the
+ * counter did not move, so they never wait on a lock. Only the holder of
+ * the lease queries the cluster and writes the map. The lease is one word,
+ * pid and expiry, taken over when its holder died or ran out of time.
+ * IPs are stored after the host mask, every process is expected to use
+ * the same. */
+
+#define _SHM_MAGIC 0x52435431   /* "RCT1" */
+#define _SHM_NO_NODE 0xffff
+/* Longest refresh a leader may take before another process takes over */
+#define _SHM_LEASE_SEC 10
+/* Readers give up on a map being rewritten after that many tries */
+#define _SHM_READ_TRIES 1000
+/* Poll period while waiting for the leader */
+#define _SHM_WAIT_NS 1000000
+
+typedef struct {
+    char ip[64];
+    int32_t port;
+    int32_t master_id;
+} _redis_cluster_shm_node;
+
+typedef struct {
+    int32_t node_count;
+    _redis_cluster_shm_node nodes[REDIS_CLUSTER_NODE_COUNT];
+    uint16_t slots[REDIS_CLUSTER_SLOTS];
+} _redis_cluster_shm_map;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t seq;       /* 0 until the first publish, odd while written */
+    uint64_t lease;     /* Leader pid << 32 | expiry in CLOCK_MONOTONIC seconds, 0 for none */
+    _redis_cluster_shm_map map;
+} _redis_cluster_shm_seg;
+
+struct _redis_cluster_shm_st {
+    _redis_cluster_shm_seg *seg;
+    uint64_t seen;      /* seq of the map in use */
+    int leading;
+    _redis_cluster_shm_map map;     /* Copy being read or written */
+};
+
+static uint32_t _redis_cluster_shm_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)now.tv_sec;
+}
+
+static int _redis_cluster_shm_lead(_redis_cluster_shm_st *shm)
+{
+    uint64_t lease = __atomic_load_n(&shm->seg->lease, __ATOMIC_ACQUIRE);
+    uint32_t owner = (uint32_t)(lease >> 32);
+    uint32_t now = _redis_cluster_shm_now();
+
+    if (0 != lease && now < (uint32_t)lease && (0 == kill((pid_t)owner, 0) || EPERM == errno)) {
+        return -1;
+    }
+    if (!__atomic_compare_exchange_n(&shm->seg->lease, &lease, ((uint64_t)getpid() << 32) | (now + _SHM_LEASE_SEC),
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    shm->leading = 1;
+    return 0;
+}
+
+/* Still the leader: extend the lease unless it was taken over, a refresh
+ * may have outlived it */
+static int _redis_cluster_shm_renew(_redis_cluster_shm_st *shm)
+{
+    uint64_t lease = __atomic_load_n(&shm->seg->lease, __ATOMIC_ACQUIRE);
+
+    if ((uint32_t)(lease >> 32) != (uint32_t)getpid()) {
+        return -1;
+    }
+    if (!__atomic_compare_exchange_n(&shm->seg->lease, &lease, ((uint64_t)getpid() << 32) | (_redis_cluster_shm_now() + _SHM_LEASE_SEC),
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void _redis_cluster_shm_release(_redis_cluster_shm_st *shm)
+{
+    uint64_t lease = __atomic_load_n(&shm->seg->lease, __ATOMIC_ACQUIRE);
+
+    /* Taken over meanwhile when the pid does not match */
+    if ((uint32_t)(lease >> 32) == (uint32_t)getpid()) {
+        __atomic_compare_exchange_n(&shm->seg->lease, &lease, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+    shm->leading = 0;
+}
+
+/* Version published and not in use here */
+static int _redis_cluster_shm_newer(_redis_cluster_shm_st *shm)
+{
+    uint64_t seq = __atomic_load_n(&shm->seg->seq, __ATOMIC_ACQUIRE);
+    return 0 != seq && 0 == (seq & 1) && seq != shm->seen;
+}
+
+static int _redis_cluster_shm_read(_redis_cluster_shm_st *shm, uint64_t *seq)
+{
+    uint64_t begin;
+    int tries;
+
+    for (tries = 0; tries < _SHM_READ_TRIES; ++tries) {
+        begin = __atomic_load_n(&shm->seg->seq, __ATOMIC_ACQUIRE);
+        if (0 == begin) {
+            return -1;
+        }
+        if (begin & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(&shm->map, &shm->seg->map, sizeof(shm->map));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seg->seq, __ATOMIC_RELAXED) == begin) {
+            *seq = begin;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int _redis_cluster_shm_adopt(redis_cluster_st *cluster)
+{
+    _redis_cluster_shm_st *shm = cluster->shm;
+    _redis_cluster_shm_map *map = &shm->map;
+    redis_cluster_node_st *nodes[REDIS_CLUSTER_NODE_COUNT];
+    uint64_t seq;
+    int count;
+    int k;
+
+    if (_redis_cluster_shm_read(shm, &seq) < 0) {
+        return -1;
+    }
+    count = map->node_count;
+    if (count <= 0 || count > REDIS_CLUSTER_NODE_COUNT) {
+        return -1;
+    }
+    for (k = 0; k < REDIS_CLUSTER_SLOTS; ++k) {
+        if (_SHM_NO_NODE != map->slots[k] && map->slots[k] >= count) {
+            return -1;
+        }
+    }
+
+    for (k = 0; k < count; ++k) {
+        map->nodes[k].ip[sizeof(map->nodes[k].ip) - 1] = '\0';
+        nodes[k] = _redis_cluster_node_init(k, map->nodes[k].ip, map->nodes[k].port);
+        if (!nodes[k]) {
+            while (k-- > 0) {
+                _redis_cluster_node_free(nodes[k]);
+            }
+            return -1;
+        }
+        nodes[k]->master_id = map->nodes[k].master_id < count ? map->nodes[k].master_id : -1;
+    }
+
+    _redis_cluster_install(cluster, nodes, count, map->slots);
+    shm->seen = seq;
+    return 0;
+}
+
+void _redis_cluster_shm_check(redis_cluster_st *cluster)
+{
+    if (_redis_cluster_shm_newer(cluster->shm)) {
+        _redis_cluster_shm_adopt(cluster);
+    }
+}
+
+void _redis_cluster_shm_publish(redis_cluster_st *cluster)
+{
+    _redis_cluster_shm_st *shm = cluster->shm;
+    _redis_cluster_shm_map *map = &shm->map;
+    int leading = shm->leading;
+    uint64_t enter;
+    uint64_t seq;
+    int k;
+
+    /* Someone else is refreshing, its map comes next */
+    if (!leading && _redis_cluster_shm_lead(shm) < 0) {
+        return;
+    }
+    /* Taken over while refreshing, the new leader publishes */
+    if (_redis_cluster_shm_renew(shm) < 0) {
+        shm->leading = 0;
+        return;
+    }
+
+    memset(map, 0x00, sizeof(*map));
+    map->node_count = cluster->node_count;
+    for (k = 0; k < cluster->node_count; ++k) {
+        snprintf(map->nodes[k].ip, sizeof(map->nodes[k].ip), "%s", cluster->redis_nodes[k]->ip);
+        map->nodes[k].port = cluster->redis_nodes[k]->port;
+        map->nodes[k].master_id = cluster->redis_nodes[k]->master_id;
+    }
+    for (k = 0; k < REDIS_CLUSTER_SLOTS; ++k) {
+        map->slots[k] = cluster->slots_handler[k] ? (uint16_t)cluster->slots_handler[k]->id : _SHM_NO_NODE;
+    }
+
+    /* Entered by CAS, a writer whose lease ran out may still be inside.
+     * Odd means one died or stalls half way, its lease is gone as ours
+     * holds: step over it, its own exit then fails. */
+    seq = __atomic_load_n(&shm->seg->seq, __ATOMIC_ACQUIRE);
+    enter = (seq & 1) ? seq + 2 : seq + 1;
+    if (__atomic_compare_exchange_n(&shm->seg->seq, &seq, enter, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(&shm->seg->map, map, sizeof(*map));
+        if (__atomic_compare_exchange_n(&shm->seg->seq, &enter, enter + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            shm->seen = enter + 1;
+        }
+    }
+
+    if (!leading) {
+        _redis_cluster_shm_release(shm);
+    }
+}
+
+int _redis_cluster_shm_refresh(redis_cluster_st *cluster, int failed_id)
+{
+    _redis_cluster_shm_st *shm = cluster->shm;
+    struct timespec start;
+    struct timespec now;
+    struct timespec wait = {0, _SHM_WAIT_NS};
+    long timeout_ms = cluster->timeout.tv_sec * 1000 + cluster->timeout.tv_usec / 1000;
+    int rc;
+
+    /* Another process already refreshed */
+    if (_redis_cluster_shm_newer(shm) && 0 == _redis_cluster_shm_adopt(cluster)) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        if (0 == _redis_cluster_shm_lead(shm)) {
+            rc = _redis_cluster_refresh_nodes(cluster, failed_id);
+            _redis_cluster_shm_release(shm);
+            return rc;
+        }
+
+        /* Wait for the leader rather than add to the load on the cluster */
+        nanosleep(&wait, NULL);
+        if (_redis_cluster_shm_newer(shm) && 0 == _redis_cluster_shm_adopt(cluster)) {
+            return 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= timeout_ms) {
+            break;
+        }
+    }
+
+    /* Leader too slow, refresh for this process only */
+    return _redis_cluster_refresh_nodes(cluster, failed_id);
+}
+
+void _redis_cluster_shm_free(redis_cluster_st *cluster)
+{
+    _redis_cluster_shm_st *shm = cluster->shm;
+
+    if (!shm) {
+        return;
+    }
+    if (shm->leading) {
+        _redis_cluster_shm_release(shm);
+    }
+    munmap(shm->seg, sizeof(_redis_cluster_shm_seg));
+    free(shm);
+    cluster->shm = NULL;
+}
+
+int redis_cluster_set_shared_topology(redis_cluster_st *cluster, const char *path)
+{
+    if (!cluster) {
+        return -1;
+    }
+
+    _redis_cluster_shm_st *shm;
+    uint32_t magic = 0;
+    void *addr;
+    int fd;
+
+    _redis_cluster_shm_free(cluster);
+    if (!path) {
+        return 0;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    /* Every process sizes it the same, a new file reads as all zero */
+    if (ftruncate(fd, sizeof(_redis_cluster_shm_seg)) < 0) {
+        close(fd);
+        return -1;
+    }
+    addr = mmap(NULL, sizeof(_redis_cluster_shm_seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == addr) {
+        return -1;
+    }
+
+    shm = (_redis_cluster_shm_st *)calloc(1, sizeof(_redis_cluster_shm_st));
+    if (!shm) {
+        munmap(addr, sizeof(_redis_cluster_shm_seg));
+        return -1;
+    }
+    shm->seg = (_redis_cluster_shm_seg *)addr;
+
+    /* Claim a new segment, refuse one laid out by another version */
+    if (!__atomic_compare_exchange_n(&shm->seg->magic, &magic, _SHM_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+            && _SHM_MAGIC != magic) {
+        munmap(addr, sizeof(_redis_cluster_shm_seg));
+        free(shm);
+        return -1;
+    }
+    magic = 0;
+    if (!__atomic_compare_exchange_n(&shm->seg->size, &magic, sizeof(_redis_cluster_shm_seg), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+            && sizeof(_redis_cluster_shm_seg) != magic) {
+        munmap(addr, sizeof(_redis_cluster_shm_seg));
+        free(shm);
+        return -1;
+    }
+    cluster->shm = shm;
+
+    /* Already connected, share what is known */
+    if (cluster->node_count > 0 && 0 == __atomic_load_n(&shm->seg->seq, __ATOMIC_ACQUIRE)) {
+        _redis_cluster_shm_publish(cluster);
+    }
+    return 0;
+}
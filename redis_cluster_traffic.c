@@ -0,0 +1,152 @@
+#include "redis_cluster.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Hot keys are tracked with Space-Saving: a full table replaces its
+ * smallest counter, inheriting its count as the error bound. Only one in
+ * sample_rate keys on average reaches the table. */
+struct _redis_cluster_hotkeys_st {
+    int capacity;
+    int used;
+    int sample_rate;
+    int countdown;
+    redis_cluster_hotkey_st entries[];
+};
+
+static void _redis_cluster_traffic_rearm(redis_cluster_st *cluster, _redis_cluster_hotkeys_st *hotkeys)
+{
+    /* Random gaps averaging sample_rate, a fixed stride would alias with periodic traffic */
+    hotkeys->countdown = hotkeys->sample_rate > 1 ? 1 + rand_r(&cluster->retry_seed) % (2 * hotkeys->sample_rate - 1) : 1;
+}
+
+void _redis_cluster_traffic_slot(redis_cluster_st *cluster, int slot)
+{
+    if (cluster->slot_traffic) {
+        ++cluster->slot_traffic[slot];
+    }
+}
+
+void _redis_cluster_traffic_key(redis_cluster_st *cluster, int slot, const char *key, size_t len)
+{
+    _redis_cluster_hotkeys_st *hotkeys = cluster->hotkeys;
+    redis_cluster_hotkey_st *entry;
+    int min = 0;
+    int i;
+
+    if (!hotkeys || --hotkeys->countdown > 0) {
+        return;
+    }
+    _redis_cluster_traffic_rearm(cluster, hotkeys);
+
+    if (len > REDIS_CLUSTER_HOTKEY_LEN) {
+        len = REDIS_CLUSTER_HOTKEY_LEN;
+    }
+    /* The slot is already known and rules out almost every entry */
+    for (i = 0; i < hotkeys->used; ++i) {
+        entry = &hotkeys->entries[i];
+        if (entry->slot == slot && entry->len == len && 0 == memcmp(entry->key, key, len)) {
+            ++entry->count;
+            return;
+        }
+        if (entry->count < hotkeys->entries[min].count) {
+            min = i;
+        }
+    }
+
+    if (hotkeys->used < hotkeys->capacity) {
+        entry = &hotkeys->entries[hotkeys->used++];
+        entry->error = 0;
+        entry->count = 1;
+    } else {
+        entry = &hotkeys->entries[min];
+        entry->error = entry->count;
+        ++entry->count;
+    }
+    entry->slot = slot;
+    entry->len = len;
+    memcpy(entry->key, key, len);
+}
+
+void _redis_cluster_traffic_free(redis_cluster_st *cluster)
+{
+    free(cluster->slot_traffic);
+    cluster->slot_traffic = NULL;
+    free(cluster->hotkeys);
+    cluster->hotkeys = NULL;
+}
+
+int redis_cluster_set_traffic_sampling(redis_cluster_st *cluster, int top_k, int sample_rate)
+{
+    if (!cluster || top_k < 0 || top_k > REDIS_CLUSTER_HOTKEY_MAX || sample_rate <= 0) {
+        return -1;
+    }
+
+    _redis_cluster_traffic_free(cluster);
+    if (0 == top_k) {
+        return 0;
+    }
+
+    cluster->slot_traffic = (uint64_t *)calloc(REDIS_CLUSTER_SLOTS, sizeof(uint64_t));
+    cluster->hotkeys = (_redis_cluster_hotkeys_st *)calloc(1, sizeof(_redis_cluster_hotkeys_st) + top_k * sizeof(redis_cluster_hotkey_st));
+    if (!cluster->slot_traffic || !cluster->hotkeys) {
+        _redis_cluster_traffic_free(cluster);
+        return -1;
+    }
+    cluster->hotkeys->capacity = top_k;
+    cluster->hotkeys->sample_rate = sample_rate;
+    _redis_cluster_traffic_rearm(cluster, cluster->hotkeys);
+    return 0;
+}
+
+static int _redis_cluster_hotkey_cmp(const void *a, const void *b)
+{
+    const redis_cluster_hotkey_st *x = (const redis_cluster_hotkey_st *)a;
+    const redis_cluster_hotkey_st *y = (const redis_cluster_hotkey_st *)b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return 0;
+}
+
+int redis_cluster_traffic_snapshot(redis_cluster_st *cluster, redis_cluster_traffic_snapshot_st *snapshot, int reset)
+{
+    if (!cluster || !snapshot || !cluster->slot_traffic) {
+        return -1;
+    }
+
+    _redis_cluster_hotkeys_st *hotkeys = cluster->hotkeys;
+    int i;
+
+    snapshot->total = 0;
+    for (i = 0; i < REDIS_CLUSTER_SLOTS; ++i) {
+        snapshot->slots[i] = cluster->slot_traffic[i];
+        snapshot->total += cluster->slot_traffic[i];
+    }
+
+    /* Sampled counts scaled back to commands */
+    snapshot->sample_rate = hotkeys->sample_rate;
+    snapshot->key_count = hotkeys->used;
+    memcpy(snapshot->keys, hotkeys->entries, hotkeys->used * sizeof(redis_cluster_hotkey_st));
+    for (i = 0; i < snapshot->key_count; ++i) {
+        snapshot->keys[i].count *= hotkeys->sample_rate;
+        snapshot->keys[i].error *= hotkeys->sample_rate;
+    }
+    qsort(snapshot->keys, snapshot->key_count, sizeof(redis_cluster_hotkey_st), _redis_cluster_hotkey_cmp);
+
+    if (reset) {
+        memset(cluster->slot_traffic, 0x00, REDIS_CLUSTER_SLOTS * sizeof(uint64_t));
+        hotkeys->used = 0;
+    }
+    return 0;
+}
+
+int redis_cluster_traffic_key(redis_cluster_st *cluster, int slot, const char *key, size_t len)
+{
+    if (!cluster || !key || slot < 0 || slot >= REDIS_CLUSTER_SLOTS) {
+        return -1;
+    }
+
+    _redis_cluster_traffic_key(cluster, slot, key, len);
+    return 0;
+}
@@ -0,0 +1,287 @@
+#include "redis_cluster.h"
+
+#ifdef REDIS_CLUSTER_USE_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <liburing.h>
+
+/* One receive buffer per node, same size as the hiredis reader chunk */
+#define _URING_BUF_SIZE (16 * 1024)
+/* Send + recv per node, each followed by its linked timeout, then a cancel */
+#define _URING_QUEUE_DEPTH (REDIS_CLUSTER_NODE_COUNT * 5)
+
+#define _URING_OP_SEND 1
+#define _URING_OP_RECV 2
+#define _URING_OP_TIMEOUT 3
+#define _URING_OP_CANCEL 4
+#define _URING_TAG(id, op) (((uint64_t)(id) << 8) | (op))
+#define _URING_TAG_ID(tag) ((int)((tag) >> 8))
+#define _URING_TAG_OP(tag) ((int)((tag) & 0xFF))
+
+struct _redis_cluster_uring_st {
+    struct io_uring ring;
+    char *bufs;
+    int registered;
+};
+
+int _redis_cluster_uring_init(redis_cluster_st *cluster)
+{
+    _redis_cluster_uring_st *uring = (_redis_cluster_uring_st *)malloc(sizeof(_redis_cluster_uring_st));
+    if (!uring) {
+        return -1;
+    }
+    memset(uring, 0x00, sizeof(_redis_cluster_uring_st));
+
+    uring->bufs = (char *)malloc(REDIS_CLUSTER_NODE_COUNT * _URING_BUF_SIZE);
+    if (!uring->bufs) {
+        free(uring);
+        return -1;
+    }
+
+    /* Kernel without io_uring, or blocked by seccomp */
+    if (io_uring_queue_init(_URING_QUEUE_DEPTH, &uring->ring, 0) < 0) {
+        free(uring->bufs);
+        free(uring);
+        return -1;
+    }
+
+    /* Registered buffers are optional, RLIMIT_MEMLOCK may be too small */
+    struct iovec iov;
+    iov.iov_base = uring->bufs;
+    iov.iov_len = REDIS_CLUSTER_NODE_COUNT * _URING_BUF_SIZE;
+    uring->registered = (0 == io_uring_register_buffers(&uring->ring, &iov, 1));
+
+    cluster->uring = uring;
+    return 0;
+}
+
+void _redis_cluster_uring_free(redis_cluster_st *cluster)
+{
+    if (!cluster->uring) {
+        return;
+    }
+
+    io_uring_queue_exit(&cluster->uring->ring);
+    free(cluster->uring->bufs);
+    free(cluster->uring);
+    cluster->uring = NULL;
+}
+
+static void _redis_cluster_uring_set_error(redisContext *ctx, int type, const char *str)
+{
+    ctx->err = type;
+    snprintf(ctx->errstr, sizeof(ctx->errstr), "%s", str);
+}
+
+static void _redis_cluster_uring_link_timeout(struct io_uring *ring, struct __kernel_timespec *ts, int id)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    io_uring_prep_link_timeout(sqe, ts, 0);
+    sqe->user_data = _URING_TAG(id, _URING_OP_TIMEOUT);
+}
+
+/* One pipeline round: flush the output buffer of every node and receive
+ * from every node that still owes replies, all in a single submission.
+ * The round ends once the target has data and the sends are done, the
+ * receives still open are cancelled and posted again by a later round.
+ * Returns -1 only when the target node failed. */
+static int _redis_cluster_uring_round(redis_cluster_st *cluster, redis_cluster_node_st *target)
+{
+    _redis_cluster_uring_st *uring = cluster->uring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct __kernel_timespec ts;
+    redis_cluster_node_st *node;
+    redisContext *ctx;
+    char *buf;
+    unsigned head;
+    unsigned seen;
+    int recv_open[REDIS_CLUSTER_NODE_COUNT];
+    int sends = 0;
+    int target_done = 0;
+    int cancelled = 0;
+    int expect = 0;
+    int rc;
+    int i;
+
+    if (!target->ctx || target->ctx->err || target->id >= REDIS_CLUSTER_NODE_COUNT) {
+        return -1;
+    }
+
+    ts.tv_sec = cluster->timeout.tv_sec;
+    ts.tv_nsec = (long long)cluster->timeout.tv_usec * 1000;
+
+    for (i = 0; i < cluster->node_count; ++i) {
+        recv_open[i] = 0;
+        node = cluster->redis_nodes[i];
+        if (!node || !node->ctx || node->ctx->err || node->id >= REDIS_CLUSTER_NODE_COUNT) {
+            continue;
+        }
+        ctx = node->ctx;
+
+        if (sdslen(ctx->obuf) > 0) {
+            sqe = io_uring_get_sqe(&uring->ring);
+            io_uring_prep_send(sqe, ctx->fd, ctx->obuf, sdslen(ctx->obuf), MSG_NOSIGNAL);
+            sqe->user_data = _URING_TAG(node->id, _URING_OP_SEND);
+            sqe->flags |= IOSQE_IO_LINK;
+            _redis_cluster_uring_link_timeout(&uring->ring, &ts, node->id);
+            expect += 2;
+            ++sends;
+        }
+
+        /* A node with unparsed bytes may already hold its replies, only the
+         * target is known to need more data. */
+        if (node != target && (node->pending <= 0 || ctx->reader->pos < ctx->reader->len)) {
+            continue;
+        }
+
+        buf = uring->bufs + (size_t)node->id * _URING_BUF_SIZE;
+        sqe = io_uring_get_sqe(&uring->ring);
+        if (uring->registered) {
+            io_uring_prep_read_fixed(sqe, ctx->fd, buf, _URING_BUF_SIZE, 0, 0);
+        } else {
+            io_uring_prep_recv(sqe, ctx->fd, buf, _URING_BUF_SIZE, 0);
+        }
+        sqe->user_data = _URING_TAG(node->id, _URING_OP_RECV);
+        sqe->flags |= IOSQE_IO_LINK;
+        _redis_cluster_uring_link_timeout(&uring->ring, &ts, node->id);
+        expect += 2;
+        recv_open[i] = 1;
+    }
+
+    ++cluster->io_stats.rounds;
+    /* Not waited for here, the wait ends with the target */
+    do {
+        rc = io_uring_submit(&uring->ring);
+        ++cluster->io_stats.enters;
+    } while (-EINTR == rc);
+    if (rc < 0) {
+        _redis_cluster_uring_set_error(target->ctx, REDIS_ERR_IO, "io_uring submit fail");
+        return -1;
+    }
+
+    while (expect > 0) {
+        seen = 0;
+        io_uring_for_each_cqe(&uring->ring, head, cqe) {
+            ++seen;
+            i = _URING_TAG_ID(cqe->user_data);
+            if (_URING_OP_TIMEOUT == _URING_TAG_OP(cqe->user_data) || _URING_OP_CANCEL == _URING_TAG_OP(cqe->user_data)
+                    || i >= cluster->node_count) {
+                continue;
+            }
+            node = cluster->redis_nodes[i];
+            ctx = node->ctx;
+
+            if (_URING_OP_SEND == _URING_TAG_OP(cqe->user_data)) {
+                --sends;
+                if (cqe->res > 0) {
+                    sdsrange(ctx->obuf, cqe->res, -1);
+                } else if (-ECANCELED == cqe->res) {
+                    _redis_cluster_uring_set_error(ctx, REDIS_ERR_TIMEOUT, "Send timeout");
+                } else {
+                    _redis_cluster_uring_set_error(ctx, REDIS_ERR_IO, strerror(-cqe->res));
+                }
+                continue;
+            }
+
+            recv_open[i] = 0;
+            if (node == target) {
+                target_done = 1;
+            }
+            if (cqe->res > 0) {
+                buf = uring->bufs + (size_t)node->id * _URING_BUF_SIZE;
+                if (REDIS_OK != redisReaderFeed(ctx->reader, buf, cqe->res)) {
+                    _redis_cluster_uring_set_error(ctx, REDIS_ERR_OOM, "Reader feed fail");
+                }
+            } else if (0 == cqe->res) {
+                _redis_cluster_uring_set_error(ctx, REDIS_ERR_EOF, "Server closed the connection");
+            } else if (-ECANCELED == cqe->res) {
+                /* Nothing arrived in time, only fatal for the target */
+                if (node == target) {
+                    _redis_cluster_uring_set_error(ctx, REDIS_ERR_TIMEOUT, "Resource temporarily unavailable");
+                }
+            } else {
+                _redis_cluster_uring_set_error(ctx, REDIS_ERR_IO, strerror(-cqe->res));
+            }
+        }
+        io_uring_cq_advance(&uring->ring, seen);
+        expect -= seen;
+
+        /* The output buffers are not touched until every send is back, the
+         * other nodes' receives are cut short then */
+        if (target_done && 0 == sends && !cancelled) {
+            cancelled = 1;
+            for (i = 0; i < cluster->node_count; ++i) {
+                if (!recv_open[i]) {
+                    continue;
+                }
+                sqe = io_uring_get_sqe(&uring->ring);
+                io_uring_prep_cancel(sqe, (void *)(uintptr_t)_URING_TAG(i, _URING_OP_RECV), 0);
+                sqe->user_data = _URING_TAG(i, _URING_OP_CANCEL);
+                ++expect;
+            }
+            /* A cancelled receive completes at once, with or without data,
+             * so what is left to reap does not wait on the network */
+            do {
+                rc = io_uring_submit(&uring->ring);
+                ++cluster->io_stats.enters;
+            } while (-EINTR == rc);
+            if (rc < 0) {
+                _redis_cluster_uring_set_error(target->ctx, REDIS_ERR_IO, "io_uring submit fail");
+                return -1;
+            }
+        }
+
+        /* One completion at a time, the target may be done before the rest */
+        if (expect > 0) {
+            rc = io_uring_wait_cqe(&uring->ring, &cqe);
+            ++cluster->io_stats.enters;
+            if (rc < 0 && -EINTR != rc) {
+                _redis_cluster_uring_set_error(target->ctx, REDIS_ERR_IO, "io_uring wait fail");
+                return -1;
+            }
+        }
+    }
+
+    return target->ctx->err ? -1 : 0;
+}
+
+int _redis_cluster_uring_get_reply(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node, void **reply)
+{
+    *reply = NULL;
+    do {
+        if (REDIS_OK != redisGetReplyFromReader(cluster_node->ctx, reply)) {
+            return REDIS_ERR;
+        }
+        if (*reply) {
+            return REDIS_OK;
+        }
+    } while (0 == _redis_cluster_uring_round(cluster, cluster_node));
+
+    return REDIS_ERR;
+}
+
+#else
+
+int _redis_cluster_uring_init(redis_cluster_st *cluster)
+{
+    /* Built without REDIS_CLUSTER_USE_URING */
+    return -1;
+}
+
+void _redis_cluster_uring_free(redis_cluster_st *cluster)
+{
+}
+
+int _redis_cluster_uring_get_reply(redis_cluster_st *cluster, redis_cluster_node_st *cluster_node, void **reply)
+{
+    return redisGetReply(cluster_node->ctx, reply);
+}
+
+#endif // REDIS_CLUSTER_USE_URING
@@ -0,0 +1,40 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "redis_cluster.hpp"
+
+/* Same commands through the C++ layer: a single SET/GET, a pipeline and a batch */
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::printf("Usage: %s host port\n", argv[0]);
+        return -1;
+    }
+
+    redis_cluster::cluster c;
+    if (!c.connect({{argv[1], std::atoi(argv[2])}}, 1000)) {
+        std::printf("Connect to redis cluster fail.\n");
+        return -1;
+    }
+
+    std::string cmd = redis_cluster::format_command("SET", "{user1}.name", "tom");
+    std::printf("RESP %zu bytes, slot %d\n", cmd.size(), redis_cluster::keyslot("{user1}.name"));
+
+    redis_cluster::reply r = c.execute("{user1}.name", "SET", "{user1}.name", "tom");
+    std::printf("SET: %.*s\n", (int)r.str().size(), r.str().data());
+
+    redis_cluster::pipeline p(c);
+    p.append("{user1}.age", "INCRBY", "{user1}.age", 1);
+    p.append("{user1}.name", "GET", "{user1}.name");
+    while (p.pending() > 0) {
+        r = p.get_reply();
+        std::printf("pipeline: type %d\n", r.type());
+    }
+
+    redis_cluster::batch b(c);
+    b.add("a", "GET", "a").add("b", "GET", "b");
+    for (redis_cluster::reply &br : b.exec()) {
+        std::printf("batch: type %d\n", br.type());
+    }
+    return 0;
+}